@@ -0,0 +1,172 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Connect a Linux host to a V2Link chain over a tty, or connect two processes
+// over a pseudo terminal.
+//
+// The root of a chain prints the messages it receives, and sends the MIDI
+// messages read from stdin, one per line: the address, 0 is the first device,
+// and the four bytes of the MIDI packet, in hex. A device at the end of a chain
+// (-d) prints the messages it receives and returns the MIDI messages to the
+// root.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I extras/host -I ../V2MIDI/src -I src extras/bridge/bridge.cpp -o v2link-bridge
+//
+// Usage:
+//   v2link-bridge [-d] [-t usec] <tty>|-p
+//     -d       be a device, not the root
+//     -t usec  the timeout for a partial frame, default 20000
+//     -p       create a pseudo terminal and print the name of the other end
+//
+//   v2link-bridge -p
+//   v2link-bridge -d /dev/pts/<n>
+
+#include <PosixUart.h>
+#include <V2Link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void printPacket(const char *from, V2Link::Packet *packet) {
+  V2MIDI::Packet midi;
+  if (packet->receive(&midi)) {
+    const uint8_t *data = midi.getData();
+    printf("%s address %3u MIDI %02x %02x %02x %02x\n", from, packet->getAddress(), data[0], data[1], data[2], data[3]);
+
+  } else
+    printf("%s address %3u type %u\n", from, packet->getAddress(), (uint8_t)packet->getType());
+
+  fflush(stdout);
+}
+
+class Root : public V2Link {
+public:
+  using V2Link::V2Link;
+
+private:
+  void receiveSocket(Packet *packet) override {
+    printPacket("socket", packet);
+  }
+
+  void linkChanged(Port *port, Port::State state) override {
+    printf("link %s\n", state == Port::State::Down ? "down" : "up");
+    fflush(stdout);
+  }
+};
+
+class Device : public V2Link {
+public:
+  using V2Link::V2Link;
+
+private:
+  void receivePlug(Packet *packet) override {
+    printPacket("plug", packet);
+
+    V2MIDI::Packet midi;
+    if (packet->receive(&midi)) {
+      midi.setPort(0);
+      plug->send(&midi);
+    }
+  }
+
+  void linkChanged(Port *port, Port::State state) override {
+    printf("link %s\n", state == Port::State::Down ? "down" : "up");
+    fflush(stdout);
+  }
+};
+
+// Send the complete lines read from stdin.
+static void readInput(V2Link::Port *port) {
+  static char line[256];
+  static size_t length;
+
+  const ssize_t n = read(STDIN_FILENO, line + length, sizeof(line) - 1 - length);
+  if (n <= 0)
+    return;
+
+  length += n;
+  line[length] = '\0';
+
+  char *end;
+  while ((end = strchr(line, '\n'))) {
+    *end = '\0';
+
+    unsigned address, data[4];
+    if (sscanf(line, "%x %x %x %x %x", &address, &data[0], &data[1], &data[2], &data[3]) == 5 &&
+        address <= V2Link::maxAddress) {
+      const uint8_t bytes[4]{(uint8_t)data[0], (uint8_t)data[1], (uint8_t)data[2], (uint8_t)data[3]};
+      V2MIDI::Packet midi;
+      midi.setData(bytes);
+      midi.setPort(address);
+      port->send(&midi);
+
+    } else
+      fprintf(stderr, "Invalid message: %s\n", line);
+
+    length -= end + 1 - line;
+    memmove(line, end + 1, length + 1);
+  }
+
+  // Drop a line which does not fit.
+  if (length == sizeof(line) - 1)
+    length = 0;
+}
+
+int main(int argc, char **argv) {
+  bool device      = false;
+  bool pty         = false;
+  uint32_t timeout = 20 * 1000;
+  const char *path = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-d") == 0)
+      device = true;
+
+    else if (strcmp(argv[i], "-p") == 0)
+      pty = true;
+
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      timeout = strtoul(argv[++i], nullptr, 10);
+
+    else
+      path = argv[i];
+  }
+
+  if (pty == (path != nullptr)) {
+    fprintf(stderr, "Usage: %s [-d] [-t usec] <tty>|-p\n", argv[0]);
+    return 1;
+  }
+
+  PosixUart *uart = pty ? new PosixUart() : new PosixUart(path);
+  if (!uart->isOpen()) {
+    fprintf(stderr, "Unable to open: %s\n", pty ? "pseudo terminal" : path);
+    return 1;
+  }
+
+  if (pty) {
+    printf("pty %s\n", uart->getPtyName());
+    fflush(stdout);
+  }
+
+  V2Link::Port port(uart, 0, {3000000, 1000, 100 * 1000, 0, 1000 * 1000, timeout});
+  Root root(nullptr, &port);
+  Device child(&port, nullptr);
+  V2Link *link = device ? (V2Link *)&child : (V2Link *)&root;
+
+  PosixEpoll epoll;
+  epoll.add(uart);
+  if (!device) {
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+    epoll.add(STDIN_FILENO);
+  }
+
+  link->begin();
+  for (;;) {
+    epoll.wait(1);
+    if (!device)
+      readInput(&port);
+
+    link->loop();
+  }
+}
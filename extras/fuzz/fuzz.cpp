@@ -0,0 +1,256 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Fuzz the framing of the ports and the decoding of the messages. The input is
+// a script of byte streams to the ports of a hub device, pauses, and loop()
+// calls; the frames the device sends and the decoded messages are checked.
+//
+// The script, one command per byte:
+//   00pp nnnn: the next n+1 input bytes arrive at port p; 1 and 2 are the
+//              branches, 0 and 3 the plug
+//   01tt tttt: advance the time by t microseconds
+//   10tt tttt: advance the time by t milliseconds
+//   11nn nnnn: call loop() n+1 times
+//
+// libFuzzer, or AFL++ with afl-clang-fast++:
+//   clang++ -std=c++17 -g -O1 -fsanitize=fuzzer,address,undefined
+//     -I extras/host -I ../V2MIDI/src -I src extras/fuzz/fuzz.cpp -o v2link-fuzz
+//
+// Run the inputs given as files, to reproduce a crash without libFuzzer:
+//   g++ -std=c++17 -g -fsanitize=address,undefined -DV2LINK_FUZZ_MAIN
+//     -I extras/host -I ../V2MIDI/src -I src extras/fuzz/fuzz.cpp -o v2link-fuzz
+
+#include <Arduino.h>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned long virtualUsec;
+
+static unsigned long virtualMicros() {
+  return virtualUsec;
+}
+
+#define V2LINK_MICROS virtualMicros
+#include <V2Link.h>
+
+#define check(condition)                                                                                               \
+  do {                                                                                                                 \
+    if (!(condition)) {                                                                                                \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);                                   \
+      abort();                                                                                                         \
+    }                                                                                                                  \
+  } while (0)
+
+class PulseEnvelope : public V2Link::Envelope {
+public:
+  PulseEnvelope() : V2Link::Envelope(1000, 10 * 1000) {
+    setBudget(20 * 1000, 100 * 1000);
+  }
+
+private:
+  void setDuty(uint8_t port, uint16_t duty) override {
+    check(port < 16);
+    check(duty <= 1000);
+  }
+};
+
+class Device : public V2Link {
+public:
+  using V2Link::V2Link;
+  PulseEnvelope envelope;
+
+private:
+  void receive(Packet *packet) {
+    if (packet->getType() != Packet::Type::Pulse)
+      return;
+
+    Packet::Pulse pulse;
+    packet->getPulse(&pulse);
+    check(pulse.port < 16);
+    check(pulse.watts >= 0.f && pulse.watts <= 100.f);
+    check(pulse.seconds >= 0.f && pulse.seconds <= 100.f);
+
+    // The integer decoding truncates the fractions, the small values lose a few
+    // microseconds.
+    Packet::PulseFixed fixed;
+    packet->getPulse(&fixed);
+    check(fixed.port == pulse.port);
+    check(fixed.milliwatts <= 100 * 1000);
+    check(fixed.usec <= 100 * 1000 * 1000);
+    check(fabsf(fixed.milliwatts - pulse.watts * 1000.f) <= 2.f + pulse.watts * 10.f);
+    check(fabsf(fixed.usec - pulse.seconds * 1e6f) <= 10.f + pulse.seconds * 20.f * 1000.f);
+
+    envelope.start(&fixed, virtualUsec);
+  }
+
+  void receivePlug(Packet *packet) override {
+    receive(packet);
+  }
+
+  void receiveSocket(Packet *packet) override {
+    receive(packet);
+  }
+
+  bool writeFirmware(uint32_t offset, const uint8_t *data, uint16_t length) override {
+    check(length <= 64 - 4);
+    return true;
+  }
+};
+
+// Returns the branch of the frame received in the same pass which was forwarded
+// to the plug with the given address.
+static const V2Link::Branch *findSource(const V2Link::Trace *trace,
+                                        uint16_t index,
+                                        const V2Link::Branch *branches,
+                                        uint8_t address) {
+  const V2Link::Trace::Entry *sent = trace->get(index);
+  for (uint16_t i = 0; i < index; i++) {
+    const V2Link::Trace::Entry *entry = trace->get(i);
+    if (entry->event != V2Link::Trace::Event::Receive || entry->port == 0)
+      continue;
+
+    const V2Link::Branch *branch = &branches[entry->port - 1];
+    if (entry->getType() == sent->getType() && entry->getAddress() + branch->first == address &&
+        memcmp(entry->bytes + entry->length - 4, sent->bytes + sent->length - 4, 4) == 0)
+      return branch;
+  }
+
+  return nullptr;
+}
+
+// The frames forwarded by the hub need to stay within the address range of the
+// port they are sent to, or the branch they are received from.
+static void checkTrace(const V2Link::Trace *trace, const V2Link::Branch *branches) {
+  for (uint16_t i = 0; i < trace->count(); i++) {
+    const V2Link::Trace::Entry *entry = trace->get(i);
+    check(entry->port < 3);
+    check(entry->length <= 8);
+
+    if (entry->event != V2Link::Trace::Event::Receive && entry->event != V2Link::Trace::Event::Send)
+      continue;
+
+    check(entry->length == ((entry->bytes[0] & 0x0f) == 0x0f ? 6 : 5));
+    check(entry->getType() <= V2Link::Packet::maxFrameType);
+
+    if (entry->event != V2Link::Trace::Event::Send)
+      continue;
+
+    const uint8_t type    = entry->getType();
+    const uint8_t address = entry->getAddress();
+
+    // The address of link-local frames carries the command.
+    if (type == (uint8_t)V2Link::Packet::Type::Link || type == (uint8_t)V2Link::Packet::Type::Time)
+      continue;
+
+    if (entry->port == 0) {
+      check(address != V2Link::broadcastAddress);
+      if (address == 0)
+        continue;
+
+      const V2Link::Branch *branch = findSource(trace, i, branches, address);
+      check(branch);
+      check(address <= branch->last);
+      continue;
+    }
+
+    const V2Link::Branch *branch = &branches[entry->port - 1];
+    check(address == V2Link::broadcastAddress || address <= branch->last - branch->first);
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  virtualUsec = 0xffff0000;
+
+  Uart uarts[3];
+  V2Link::Port plug(&uarts[0], 0, {3000000, 1000, 100 * 1000, 12000000, 10 * 1000, 0});
+  V2Link::Port left(&uarts[1], 0, {3000000, 1000, 100 * 1000, 12000000, 10 * 1000, 0});
+  V2Link::Port right(&uarts[2]);
+  const V2Link::Branch branches[]{{&left, 1, 3}, {&right, 4, V2Link::maxAddress}};
+  Device device(&plug, branches, 2);
+
+  uint8_t plugBuffer[64];
+  uint8_t socketBuffer[64];
+  V2Link::Bulk plugBulk(plugBuffer, sizeof(plugBuffer));
+  V2Link::Bulk socketBulk(socketBuffer, sizeof(socketBuffer));
+  device.plugBulk   = &plugBulk;
+  device.socketBulk = &socketBulk;
+
+  V2Link::Trace::Entry entries[256];
+  V2Link::Trace trace(entries, 256);
+  device.setTrace(&trace);
+  device.setTimeSync(1000);
+  device.begin();
+
+  auto loop = [&]() {
+    trace.clear();
+
+    const auto start = std::chrono::steady_clock::now();
+    device.loop();
+    device.envelope.tick(virtualUsec);
+    check(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100));
+
+    checkTrace(&trace, branches);
+    virtualUsec++;
+  };
+
+  size_t i = 0;
+  while (i < size) {
+    const uint8_t command = data[i++];
+    switch (command >> 6) {
+      case 0: {
+        const uint8_t port = (command >> 4) & 3;
+        size_t n           = (command & 0x0f) + 1;
+        if (n > size - i)
+          n = size - i;
+
+        uarts[port == 3 ? 0 : port].inject(data + i, n);
+        i += n;
+        break;
+      }
+
+      case 1:
+        virtualUsec += command & 0x3f;
+        break;
+
+      case 2:
+        virtualUsec += (command & 0x3f) * 1000;
+        break;
+
+      case 3:
+        for (uint8_t n = 0; n <= (command & 0x3f); n++)
+          loop();
+        break;
+    }
+
+    loop();
+  }
+
+  // All input needs to be consumed.
+  for (uint16_t n = 0; n < 1000; n++)
+    loop();
+
+  for (auto &uart : uarts)
+    check(uart.available() == 0);
+
+  return 0;
+}
+
+#if defined(V2LINK_FUZZ_MAIN)
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    FILE *file = fopen(argv[i], "rb");
+    if (!file) {
+      fprintf(stderr, "Unable to open: %s\n", argv[i]);
+      return 1;
+    }
+
+    uint8_t data[64 * 1024];
+    const size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    LLVMFuzzerTestOneInput(data, size);
+  }
+
+  return 0;
+}
+#endif
@@ -0,0 +1,134 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2023
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+// The parts of the Arduino core V2Link depends on, to build the library and the
+// tools in extras/ on a host system. The include path needs to list this
+// directory before V2MIDI/src and V2Link/src.
+
+#include <chrono>
+#include <deque>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+
+// The monotonic clock of the host. Simulations define V2LINK_MICROS to their
+// virtual time.
+inline unsigned long micros() {
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline unsigned long millis() {
+  return micros() / 1000;
+}
+
+inline void pinMode(uint8_t pin, uint8_t mode) {}
+inline void digitalWrite(uint8_t pin, uint8_t value) {}
+
+class Print {
+public:
+  virtual ~Print() = default;
+  virtual size_t write(uint8_t c) = 0;
+
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    for (size_t i = 0; i < size; i++)
+      if (write(buffer[i]) == 0)
+        return i;
+
+    return size;
+  }
+};
+
+// The serial port, an in-memory line; the output is appended to the input of the
+// connected port, or discarded. Host transports override the methods.
+class Uart : public Print {
+public:
+  // The size of the TX buffer of the SAMD core.
+  explicit Uart(size_t size = 64) : _size(size) {}
+
+  void connect(Uart *peer) {
+    _peer = peer;
+  }
+
+  // Append data to the input.
+  void inject(const uint8_t *buffer, size_t size) {
+    _rx.insert(_rx.end(), buffer, buffer + size);
+  }
+
+  unsigned long getBaud() const {
+    return _baud;
+  }
+
+  virtual void begin(unsigned long baud) {
+    _baud = baud;
+  }
+
+  virtual void end() {
+    _rx.clear();
+  }
+
+  virtual void setTimeout(unsigned long msec) {}
+
+  virtual int available() {
+    return _rx.size();
+  }
+
+  virtual int availableForWrite() {
+    if (!_peer)
+      return _size;
+
+    return _peer->_rx.size() < _size ? _size - _peer->_rx.size() : 0;
+  }
+
+  virtual int peek() {
+    if (_rx.empty())
+      return -1;
+
+    return _rx.front();
+  }
+
+  virtual int read() {
+    if (_rx.empty())
+      return -1;
+
+    const uint8_t c = _rx.front();
+    _rx.pop_front();
+    return c;
+  }
+
+  virtual size_t readBytes(uint8_t *buffer, size_t length) {
+    size_t i = 0;
+    for (; i < length && !_rx.empty(); i++) {
+      buffer[i] = _rx.front();
+      _rx.pop_front();
+    }
+
+    return i;
+  }
+
+  using Print::write;
+  size_t write(uint8_t c) override {
+    if (availableForWrite() == 0)
+      return 0;
+
+    if (_peer)
+      _peer->_rx.push_back(c);
+
+    return 1;
+  }
+
+  virtual void flush() {}
+
+protected:
+  const size_t _size;
+  unsigned long _baud{};
+  Uart *_peer{};
+  std::deque<uint8_t> _rx;
+};
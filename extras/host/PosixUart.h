@@ -0,0 +1,260 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2023
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+// A Uart on a POSIX file descriptor, a tty device with a USB serial adapter, or
+// a pseudo terminal to connect two processes without hardware.
+//
+// The descriptor is non-blocking. The input is read in batches into a buffer
+// when the buffer runs low, the output is collected and written with a single
+// call from available(), which the ports call at every loop() pass. Epoll waits
+// for input or writable descriptors, the process does not need to poll.
+//
+// USB serial adapters deliver the data in packets, the ports need to use a
+// frame timeout which covers the latency of the adapter.
+
+#include "Arduino.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+class PosixUart : public Uart {
+public:
+  // Open a tty device.
+  explicit PosixUart(const char *path, size_t size = 4096) : Uart(size) {
+    _fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  }
+
+  // Create a pseudo terminal, the other end is opened with getPtyName().
+  explicit PosixUart(size_t size = 4096) : Uart(size) {
+    _fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (_fd < 0)
+      return;
+
+    if (grantpt(_fd) < 0 || unlockpt(_fd) < 0) {
+      close(_fd);
+      _fd = -1;
+    }
+  }
+
+  ~PosixUart() {
+    if (_fd >= 0)
+      close(_fd);
+  }
+
+  PosixUart(const PosixUart &) = delete;
+  PosixUart &operator=(const PosixUart &) = delete;
+
+  bool isOpen() const {
+    return _fd >= 0;
+  }
+
+  int getFd() const {
+    return _fd;
+  }
+
+  const char *getPtyName() const {
+    return _fd >= 0 ? ptsname(_fd) : nullptr;
+  }
+
+  // The output is waiting for the descriptor to become writable.
+  bool isPending() const {
+    return _txPosition < _tx.size();
+  }
+
+  // The raw mode at the given rate. A rate without a termios constant keeps
+  // the current one; pseudo terminals ignore the rate.
+  void begin(unsigned long baud) override {
+    _baud = baud;
+    _rx.clear();
+    if (_fd < 0)
+      return;
+
+    struct termios tio;
+    if (tcgetattr(_fd, &tio) < 0)
+      return;
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+    tio.c_cc[VMIN]  = 0;
+    tio.c_cc[VTIME] = 0;
+
+    const speed_t speed = getSpeed(baud);
+    if (speed != B0)
+      cfsetspeed(&tio, speed);
+
+    tcsetattr(_fd, TCSANOW, &tio);
+  }
+
+  void end() override {
+    _rx.clear();
+    _tx.clear();
+    _txPosition = 0;
+  }
+
+  int available() override {
+    transfer();
+    return _rx.size();
+  }
+
+  int availableForWrite() override {
+    const size_t queued = _tx.size() - _txPosition;
+    return queued < _size ? _size - queued : 0;
+  }
+
+  using Uart::write;
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) override {
+    const size_t n = (size_t)availableForWrite() < size ? availableForWrite() : size;
+    _tx.insert(_tx.end(), buffer, buffer + n);
+    return n;
+  }
+
+  // Block until the output is written.
+  void flush() override {
+    while (isPending()) {
+      writeOutput();
+      if (isPending())
+        usleep(100);
+    }
+  }
+
+  // Write the pending output and read the available input.
+  void transfer() {
+    writeOutput();
+
+    // Read more only if the buffered input does not contain a complete frame.
+    if (_fd < 0 || _rx.size() >= 6)
+      return;
+
+    uint8_t buffer[4096];
+    const ssize_t n = ::read(_fd, buffer, sizeof(buffer));
+    if (n > 0)
+      _rx.insert(_rx.end(), buffer, buffer + n);
+  }
+
+private:
+  int _fd{-1};
+  std::vector<uint8_t> _tx;
+  size_t _txPosition{};
+
+  void writeOutput() {
+    if (_fd < 0 || !isPending())
+      return;
+
+    const ssize_t n = ::write(_fd, _tx.data() + _txPosition, _tx.size() - _txPosition);
+    if (n < 0) {
+      // The other end of a pseudo terminal is not open, drop the output.
+      if (errno == EIO) {
+        _tx.clear();
+        _txPosition = 0;
+      }
+
+      return;
+    }
+
+    _txPosition += n;
+    if (_txPosition == _tx.size()) {
+      _tx.clear();
+      _txPosition = 0;
+    }
+  }
+
+  static speed_t getSpeed(unsigned long baud) {
+    switch (baud) {
+      case 115200:
+        return B115200;
+      case 230400:
+        return B230400;
+      case 460800:
+        return B460800;
+      case 500000:
+        return B500000;
+      case 921600:
+        return B921600;
+      case 1000000:
+        return B1000000;
+      case 1500000:
+        return B1500000;
+      case 2000000:
+        return B2000000;
+      case 3000000:
+        return B3000000;
+      case 4000000:
+        return B4000000;
+      default:
+        return B0;
+    }
+  }
+};
+
+// Wait for any of the ports, and other descriptors, to have input or to accept
+// pending output.
+class PosixEpoll {
+public:
+  PosixEpoll() : _fd(epoll_create1(EPOLL_CLOEXEC)) {}
+
+  ~PosixEpoll() {
+    if (_fd >= 0)
+      close(_fd);
+  }
+
+  PosixEpoll(const PosixEpoll &) = delete;
+  PosixEpoll &operator=(const PosixEpoll &) = delete;
+
+  bool add(PosixUart *uart) {
+    if (!add(uart->getFd()))
+      return false;
+
+    _uarts.push_back({uart, false});
+    return true;
+  }
+
+  bool add(int fd) {
+    struct epoll_event event {};
+    event.events  = EPOLLIN;
+    event.data.fd = fd;
+    return epoll_ctl(_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+  }
+
+  // Returns the number of ready descriptors, 0 after the timeout.
+  int wait(int timeoutMsec) {
+    for (auto &entry : _uarts) {
+      // Do not block while there is buffered input.
+      if (entry.uart->available() > 0)
+        timeoutMsec = 0;
+
+      const bool pending = entry.uart->isPending();
+      if (pending == entry.output)
+        continue;
+
+      struct epoll_event event {};
+      event.events  = EPOLLIN | (pending ? (uint32_t)EPOLLOUT : 0u);
+      event.data.fd = entry.uart->getFd();
+      epoll_ctl(_fd, EPOLL_CTL_MOD, entry.uart->getFd(), &event);
+      entry.output = pending;
+    }
+
+    struct epoll_event events[16];
+    const int n = epoll_wait(_fd, events, 16, timeoutMsec);
+    return n > 0 ? n : 0;
+  }
+
+private:
+  struct Entry {
+    PosixUart *uart;
+    bool output;
+  };
+
+  const int _fd;
+  std::vector<Entry> _uarts;
+};
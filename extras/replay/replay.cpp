@@ -0,0 +1,267 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Replay a trace recorded with V2Link::Trace on the host. The received bytes,
+// the frames and the dropped input, are fed into a V2Link device at their
+// recorded time; the frames the device forwards and the resyncs are compared to
+// the ones in the trace, and the time spent in loop() is measured. The frames
+// the device sends itself depend on its class, which is not part of the trace,
+// they are not compared.
+//
+// Build:
+//   g++ -std=c++17 -O2 -I extras/host -I ../V2MIDI/src -I src extras/replay/replay.cpp -o v2link-replay
+//
+// Usage:
+//   v2link-replay [-p] [-b first:last]... trace.bin
+//     -p             print the entries of the trace
+//     -b first:last  a branch of a hub, in the order of the ports; without
+//                    branches, port 1 is a socket which serves all addresses
+
+#include <Arduino.h>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static unsigned long virtualUsec;
+
+static unsigned long virtualMicros() {
+  return virtualUsec;
+}
+
+#define V2LINK_MICROS virtualMicros
+#include <V2Link.h>
+
+static bool readTrace(const char *path, std::vector<V2Link::Trace::Entry> *entries) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return false;
+
+  uint8_t magic[4];
+  if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "V2LT", 4) != 0) {
+    fclose(file);
+    return false;
+  }
+
+  uint8_t bytes[16];
+  while (fread(bytes, 1, sizeof(bytes), file) == sizeof(bytes)) {
+    V2Link::Trace::Entry entry;
+    entry.usec   = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+    entry.port   = bytes[4];
+    entry.event  = (V2Link::Trace::Event)bytes[5];
+    entry.length = bytes[6] < 8 ? bytes[6] : 8;
+    memcpy(entry.bytes, bytes + 8, 8);
+    entries->push_back(entry);
+  }
+
+  fclose(file);
+  return true;
+}
+
+static void printEntry(const V2Link::Trace::Entry *entry) {
+  static const char *events[]{"receive", "send   ", "drop   ", "resync "};
+  printf("%10u port %u %s",
+         entry->usec,
+         entry->port,
+         (uint8_t)entry->event < 4 ? events[(uint8_t)entry->event] : "unknown");
+
+  if (entry->event == V2Link::Trace::Event::Receive || entry->event == V2Link::Trace::Event::Send)
+    printf(" type %2u address %3u", entry->getType(), entry->getAddress());
+
+  printf(" |");
+  for (uint8_t i = 0; i < entry->length; i++)
+    printf(" %02x", entry->bytes[i]);
+
+  printf("\n");
+}
+
+// A frame sent to the plug or to a branch, which is the last frame received
+// from a branch or from the plug with the address rebased to the branch; a port
+// does not read another frame before its current one is forwarded. The link
+// negotiation and the clock synchronization are handled by every port; they
+// depend on the timing of the peers, which is not part of the trace.
+static bool isForwarded(const V2Link::Trace::Entry *sent,
+                        const V2Link::Trace::Entry *received,
+                        const std::vector<V2Link::Branch> &branches) {
+  if (!received || received->getType() != sent->getType() || (received->port == 0) == (sent->port == 0) ||
+      memcmp(received->bytes + received->length - 4, sent->bytes + sent->length - 4, 4) != 0)
+    return false;
+
+  if (sent->getType() == (uint8_t)V2Link::Packet::Type::Link || sent->getType() == (uint8_t)V2Link::Packet::Type::Time)
+    return false;
+
+  if (sent->port == 0)
+    return received->getAddress() != V2Link::broadcastAddress &&
+           received->getAddress() + branches[received->port - 1].first == sent->getAddress();
+
+  if (received->getAddress() == V2Link::broadcastAddress)
+    return sent->getAddress() == V2Link::broadcastAddress;
+
+  return received->getAddress() == sent->getAddress() + branches[sent->port - 1].first;
+}
+
+// The forwarded frames and the resyncs of a port, in their order.
+static std::vector<const V2Link::Trace::Entry *> getCompared(const std::vector<V2Link::Trace::Entry> &entries,
+                                                             const std::vector<V2Link::Branch> &branches,
+                                                             uint8_t port) {
+  std::vector<const V2Link::Trace::Entry *> compared;
+  std::vector<const V2Link::Trace::Entry *> received(branches.size() + 1);
+  for (const auto &entry : entries) {
+    switch (entry.event) {
+      case V2Link::Trace::Event::Receive:
+        received[entry.port] = &entry;
+        break;
+
+      case V2Link::Trace::Event::Send:
+        if (entry.port != port)
+          break;
+
+        for (const V2Link::Trace::Entry *source : received)
+          if (isForwarded(&entry, source, branches)) {
+            compared.push_back(&entry);
+            break;
+          }
+        break;
+
+      case V2Link::Trace::Event::Resync:
+        if (entry.port == port)
+          compared.push_back(&entry);
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  return compared;
+}
+
+static bool isEqual(const V2Link::Trace::Entry *a, const V2Link::Trace::Entry *b) {
+  return a->port == b->port && a->event == b->event && a->length == b->length &&
+         memcmp(a->bytes, b->bytes, a->length) == 0;
+}
+
+int main(int argc, char **argv) {
+  bool print = false;
+  std::vector<V2Link::Branch> branches;
+  int i = 1;
+  for (; i < argc - 1; i++) {
+    if (strcmp(argv[i], "-p") == 0)
+      print = true;
+
+    else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc - 1) {
+      unsigned first, last;
+      if (sscanf(argv[++i], "%u:%u", &first, &last) != 2 || first == 0 || first > last || last > V2Link::maxAddress) {
+        fprintf(stderr, "Invalid branch: %s\n", argv[i]);
+        return 1;
+      }
+
+      branches.push_back({nullptr, (uint8_t)first, (uint8_t)last});
+
+    } else
+      break;
+  }
+
+  if (i != argc - 1) {
+    fprintf(stderr, "Usage: %s [-p] [-b first:last]... trace.bin\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<V2Link::Trace::Entry> trace;
+  if (!readTrace(argv[i], &trace)) {
+    fprintf(stderr, "Unable to read trace: %s\n", argv[i]);
+    return 1;
+  }
+
+  if (print)
+    for (const auto &entry : trace)
+      printEntry(&entry);
+
+  if (trace.empty())
+    return 0;
+
+  uint8_t nPorts = branches.empty() ? 2 : branches.size() + 1;
+  for (const auto &entry : trace)
+    if (entry.port >= nPorts) {
+      fprintf(stderr, "Trace uses port %u, the device has %u ports\n", entry.port, nPorts);
+      return 1;
+    }
+
+  virtualUsec = trace.front().usec;
+
+  std::vector<Uart> uarts(nPorts);
+  std::vector<V2Link::Port> ports;
+  ports.reserve(nPorts);
+  for (auto &uart : uarts)
+    ports.emplace_back(&uart);
+
+  if (branches.empty())
+    branches.push_back({nullptr, 1, V2Link::maxAddress});
+
+  for (size_t b = 0; b < branches.size(); b++)
+    branches[b].port = &ports[b + 1];
+
+  V2Link device(&ports[0], branches.data(), branches.size());
+
+  std::vector<V2Link::Trace::Entry> sent(0xffff);
+  V2Link::Trace recorder(sent.data(), sent.size());
+  device.setTrace(&recorder);
+  device.begin();
+
+  // Advance the virtual time in steps of one microsecond, the received bytes
+  // arrive at the time they were read or dropped by the recording device.
+  uint64_t loops = 0;
+  std::chrono::nanoseconds elapsed{};
+  size_t next = 0;
+  while (next < trace.size()) {
+    for (; next < trace.size() && (int32_t)(trace[next].usec - virtualUsec) <= 0; next++) {
+      const V2Link::Trace::Entry *entry = &trace[next];
+      if (entry->event != V2Link::Trace::Event::Receive && entry->event != V2Link::Trace::Event::Drop)
+        continue;
+
+      uarts[entry->port].inject(entry->bytes, entry->length);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    device.loop();
+    elapsed += std::chrono::steady_clock::now() - start;
+    loops++;
+    virtualUsec++;
+  }
+
+  std::vector<V2Link::Trace::Entry> replay;
+  for (uint16_t e = 0; e < recorder.count(); e++)
+    replay.push_back(*recorder.get(e));
+
+  // Compare the forwarded frames and the resyncs in the order of every port.
+  uint32_t compared   = 0;
+  uint32_t mismatched = 0;
+  for (uint8_t port = 0; port < nPorts; port++) {
+    const std::vector<const V2Link::Trace::Entry *> expected = getCompared(trace, branches, port);
+    const std::vector<const V2Link::Trace::Entry *> replayed = getCompared(replay, branches, port);
+    const size_t n = expected.size() < replayed.size() ? expected.size() : replayed.size();
+    for (size_t e = 0; e < n; e++) {
+      compared++;
+      if (isEqual(expected[e], replayed[e]))
+        continue;
+
+      if (mismatched++ < 10) {
+        printf("Mismatch on port %u:\n  trace:  ", port);
+        printEntry(expected[e]);
+        printf("  replay: ");
+        printEntry(replayed[e]);
+      }
+    }
+
+    if (expected.size() != replayed.size())
+      printf("Port %u: %zu forwarded frames and resyncs in the trace, %zu in the replay\n",
+             port,
+             expected.size(),
+             replayed.size());
+  }
+
+  printf("Entries: %zu, compared: %u, mismatched: %u\n", trace.size(), compared, mismatched);
+  printf("Loops: %llu, %.1f ns per loop\n", (unsigned long long)loops, loops > 0 ? (double)elapsed.count() / loops : 0);
+  return mismatched > 0 ? 2 : 0;
+}
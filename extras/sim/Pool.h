@@ -0,0 +1,75 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2023
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+// A work-stealing thread pool. The tasks are distributed across the workers,
+// a worker takes the tasks from the back of its own queue, and steals from the
+// front of the other queues when it runs out of work; tasks of uneven length
+// keep all workers busy.
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Pool {
+public:
+  explicit Pool(unsigned nThreads) : _queues(nThreads > 0 ? nThreads : 1) {}
+
+  // Run the tasks and wait for all of them to finish.
+  void run(std::vector<std::function<void()>> tasks) {
+    for (size_t i = 0; i < tasks.size(); i++)
+      _queues[i % _queues.size()].tasks.push_back(std::move(tasks[i]));
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < _queues.size(); i++)
+      threads.emplace_back([this, i]() { work(i); });
+
+    work(0);
+    for (auto &thread : threads)
+      thread.join();
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<Queue> _queues;
+
+  bool take(size_t index, bool steal, std::function<void()> *task) {
+    Queue *queue = &_queues[index];
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    if (queue->tasks.empty())
+      return false;
+
+    if (steal) {
+      *task = std::move(queue->tasks.front());
+      queue->tasks.pop_front();
+
+    } else {
+      *task = std::move(queue->tasks.back());
+      queue->tasks.pop_back();
+    }
+
+    return true;
+  }
+
+  // The tasks do not add new tasks, the work is done when all queues are empty.
+  void work(size_t index) {
+    std::function<void()> task;
+    for (;;) {
+      bool found = take(index, false, &task);
+      for (size_t i = 1; !found && i < _queues.size(); i++)
+        found = take((index + i) % _queues.size(), true, &task);
+
+      if (!found)
+        return;
+
+      task();
+    }
+  }
+};
@@ -0,0 +1,561 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2023
+// SPDX-License-Identifier: Apache-2.0
+
+// Simulate many independent chains of V2Link devices in virtual time. Every
+// chain runs its own discrete-event scheduler, the chains are distributed across
+// the cores by a work-stealing thread pool.
+//
+// The root of every chain sends MIDI messages to random devices, the devices
+// return them to the root, which measures the round-trip latency.
+//
+// Every byte occupies the line for ten bit times at the baud rate of the link,
+// and becomes visible to the receiving device after a random interrupt latency.
+// Bytes can be lost or corrupted on the line. The simulation is deterministic,
+// the same seed reproduces the same events; the digest of the delivered bytes
+// and the measured latencies verifies it.
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread -I extras/host -I ../V2MIDI/src -I src extras/sim/sim.cpp -o v2link-sim
+//
+// Usage:
+//   v2link-sim [options]
+//     -c chains       the number of chains, default 100
+//     -d devices      the number of devices per chain, without the root, default 16
+//     -r rate         messages per second per chain, default 1000
+//     -s seconds      the simulated time, default 1
+//     -b baud,...     the baud rates to compare, default 3000000
+//     -l usec         the time of a loop() pass of a device, default 5
+//     -i usec         the maximum interrupt latency, default 0
+//     -p probability  the probability that a byte is lost, default 0
+//     -x probability  the probability that a byte is corrupted, default 0
+//     -j threads      the number of threads, default all cores
+//     -S seed         the seed of the random traffic and errors, default 1
+
+#include "Pool.h"
+#include <Arduino.h>
+#include <chrono>
+#include <memory>
+#include <queue>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// The virtual time of the chain simulated by the current thread.
+static thread_local uint64_t simNsec;
+
+static unsigned long simMicros() {
+  return simNsec / 1000;
+}
+
+#define V2LINK_MICROS simMicros
+#include <V2Link.h>
+
+struct Statistics {
+  // The round-trip latency in steps of 10 µs, the last bucket counts everything
+  // beyond.
+  static constexpr uint32_t latencyStepUsec = 10;
+  static constexpr uint32_t nLatency        = 10 * 1000;
+
+  uint64_t sent{};
+  uint64_t received{};
+  uint64_t rejected{};
+  uint64_t events{};
+
+  // The frames dropped by the ports, and the bytes lost or corrupted on the line.
+  uint64_t frameErrors{};
+  uint64_t lost{};
+  uint64_t corrupted{};
+
+  // FNV-1a of the delivered bytes and the measured latencies.
+  uint64_t digest{14695981039346656037ULL};
+  uint64_t maxLatencyNsec{};
+  std::vector<uint64_t> latency = std::vector<uint64_t>(nLatency + 1);
+
+  void add(const Statistics &other) {
+    sent += other.sent;
+    received += other.received;
+    rejected += other.rejected;
+    events += other.events;
+    frameErrors += other.frameErrors;
+    lost += other.lost;
+    corrupted += other.corrupted;
+    digest = (digest ^ other.digest) * 1099511628211ULL;
+    if (other.maxLatencyNsec > maxLatencyNsec)
+      maxLatencyNsec = other.maxLatencyNsec;
+
+    for (uint32_t i = 0; i <= nLatency; i++)
+      latency[i] += other.latency[i];
+  }
+
+  void hash(uint64_t value) {
+    for (uint8_t i = 0; i < 8; i++)
+      digest = (digest ^ (uint8_t)(value >> (i * 8))) * 1099511628211ULL;
+  }
+
+  void addLatency(uint64_t nsec) {
+    hash(nsec);
+    if (nsec > maxLatencyNsec)
+      maxLatencyNsec = nsec;
+
+    const uint64_t bucket = nsec / 1000 / latencyStepUsec;
+    latency[bucket < nLatency ? bucket : nLatency]++;
+  }
+
+  // The latency in microseconds which the given fraction of messages does not
+  // exceed.
+  uint32_t getPercentile(double fraction) const {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i <= nLatency; i++) {
+      count += latency[i];
+      if (count >= fraction * received)
+        return (i + 1) * latencyStepUsec;
+    }
+
+    return 0;
+  }
+};
+
+struct Config {
+  uint32_t chains;
+  uint16_t devices;
+  uint32_t rate;
+  uint64_t durationNsec;
+  uint32_t baud;
+  uint32_t loopNsec;
+  uint32_t isrNsec;
+  double loss;
+  double corruption;
+  uint64_t seed;
+};
+
+class Chain;
+
+// One end of a link. The written bytes are delivered to the other end when they
+// have been transmitted; the bytes on the wire count against the TX buffer.
+// The interrupt latency delays the bytes, but does not reorder them.
+class SimUart : public Uart {
+public:
+  Chain *chain{};
+  SimUart *peer{};
+  uint16_t device{};
+  uint32_t inFlight{};
+
+  // The time the line is free for the next byte.
+  uint64_t lineNsec{};
+
+  // The time the last byte was delivered to the other end.
+  uint64_t deliverNsec{};
+
+  int availableForWrite() override {
+    return inFlight < _size ? _size - inFlight : 0;
+  }
+
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t *buffer, size_t size) override;
+};
+
+class Chain {
+public:
+  Statistics statistics;
+
+  Chain(const Config *config, uint32_t index) :
+    _config(config),
+    _random(config->seed + index),
+    _line(~config->seed + index) {
+    for (uint16_t i = 0; i <= config->devices; i++)
+      _nodes.emplace_back(new Node(this, i));
+
+    // Device 0 is the root, the plug of every device is connected to the socket
+    // of its parent.
+    for (uint16_t i = 1; i <= config->devices; i++) {
+      _nodes[i]->plugUart.peer       = &_nodes[i - 1]->socketUart;
+      _nodes[i - 1]->socketUart.peer = &_nodes[i]->plugUart;
+    }
+
+    const V2Link::Port::Timing timing{config->baud, 1000, 100 * 1000, 0, 0, 0};
+    for (uint16_t i = 0; i <= config->devices; i++) {
+      Node *node = _nodes[i].get();
+      node->plug.reset(new V2Link::Port(&node->plugUart, 0, timing));
+      node->socket.reset(new V2Link::Port(&node->socketUart, 0, timing));
+      node->link.reset(new Device(this,
+                                  i,
+                                  i > 0 ? node->plug.get() : nullptr,
+                                  i < config->devices ? node->socket.get() : nullptr));
+    }
+  }
+
+  void run() {
+    simNsec = 0;
+
+    for (uint16_t i = 0; i <= _config->devices; i++) {
+      _nodes[i]->link->begin();
+      schedule({tickNsec + i * tickNsec / (_config->devices + 1), Kind::Tick, i});
+    }
+
+    // Start the traffic after the ports have synchronized to the line.
+    schedule({2 * tickNsec, Kind::Traffic, 0});
+
+    while (!_events.empty()) {
+      const Event event = _events.top();
+      _events.pop();
+      simNsec = event.nsec;
+      statistics.events++;
+
+      switch (event.kind) {
+        case Kind::Loop:
+          _nodes[event.device]->loopPending = false;
+          loop(event.device);
+          break;
+
+        case Kind::Tick:
+          loop(event.device);
+          if (simNsec < _config->durationNsec + drainNsec)
+            schedule({simNsec + tickNsec, Kind::Tick, event.device});
+          break;
+
+        case Kind::Deliver:
+          statistics.hash(simNsec);
+          statistics.hash(event.byte);
+          event.uart->inject(&event.byte, 1);
+          scheduleLoop(event.uart->device);
+          break;
+
+        case Kind::Transmit:
+          event.uart->inFlight--;
+          break;
+
+        case Kind::Traffic:
+          send();
+          if (simNsec < _config->durationNsec) {
+            std::exponential_distribution<double> interval(_config->rate);
+            schedule({simNsec + (uint64_t)(interval(_random) * 1e9) + 1, Kind::Traffic, 0});
+          }
+          break;
+      }
+    }
+
+    for (const auto &node : _nodes) {
+      statistics.frameErrors += node->plug->statistics.error;
+      statistics.frameErrors += node->socket->statistics.error;
+    }
+  }
+
+  // Put the bytes on the line after the bytes already in flight; a byte leaves
+  // the TX buffer when it is transmitted.
+  void transmit(SimUart *uart, const uint8_t *data, size_t size) {
+    const uint64_t byteNsec = 10ULL * 1000 * 1000 * 1000 / uart->getBaud();
+    std::uniform_real_distribution<double> chance(0, 1);
+    std::uniform_int_distribution<uint32_t> isr(0, _config->isrNsec);
+    std::uniform_int_distribution<uint8_t> bit(0, 7);
+
+    for (size_t i = 0; i < size; i++) {
+      if (uart->lineNsec < simNsec)
+        uart->lineNsec = simNsec;
+
+      uart->lineNsec += byteNsec;
+      uart->inFlight++;
+      schedule({uart->lineNsec, Kind::Transmit, uart->device, uart});
+
+      if (_config->loss > 0 && chance(_line) < _config->loss) {
+        statistics.lost++;
+        continue;
+      }
+
+      Event event{uart->lineNsec, Kind::Deliver, uart->peer->device, uart->peer, data[i]};
+      if (_config->corruption > 0 && chance(_line) < _config->corruption) {
+        event.byte ^= 1 << bit(_line);
+        statistics.corrupted++;
+      }
+
+      if (_config->isrNsec > 0)
+        event.nsec += isr(_line);
+
+      if (event.nsec < uart->deliverNsec)
+        event.nsec = uart->deliverNsec;
+
+      uart->deliverNsec = event.nsec;
+      schedule(event);
+    }
+  }
+
+private:
+  // The housekeeping of the devices without traffic, and the time to receive
+  // the remaining messages after the traffic has stopped.
+  static constexpr uint64_t tickNsec  = 1000 * 1000;
+  static constexpr uint64_t drainNsec = 100 * 1000 * 1000;
+
+  enum class Kind : uint8_t { Loop, Tick, Transmit, Deliver, Traffic };
+
+  struct Event {
+    uint64_t nsec{};
+    Kind kind{};
+    uint16_t device{};
+    SimUart *uart{};
+    uint8_t byte{};
+    uint64_t sequence{};
+
+    // Events at the same time run in the order they were scheduled.
+    bool operator>(const Event &other) const {
+      if (nsec != other.nsec)
+        return nsec > other.nsec;
+
+      return sequence > other.sequence;
+    }
+  };
+
+  class Device : public V2Link {
+  public:
+    Device(Chain *chain, uint16_t index, Port *plug, Port *socket) :
+      V2Link(plug, socket),
+      _chain(chain),
+      _index(index) {}
+
+  private:
+    Chain *_chain;
+    const uint16_t _index;
+
+    // Return the message to the root.
+    void receivePlug(Packet *packet) override {
+      V2MIDI::Packet midi;
+      if (!packet->receive(&midi))
+        return;
+
+      midi.setPort(0);
+      plug->send(&midi);
+    }
+
+    void receiveSocket(Packet *packet) override {
+      if (_index == 0)
+        _chain->receive(packet);
+    }
+  };
+
+  struct Node {
+    SimUart plugUart;
+    SimUart socketUart;
+    std::unique_ptr<V2Link::Port> plug;
+    std::unique_ptr<V2Link::Port> socket;
+    std::unique_ptr<Device> link;
+    bool loopPending{};
+
+    Node(Chain *chain, uint16_t device) {
+      plugUart.chain    = chain;
+      plugUart.device   = device;
+      socketUart.chain  = chain;
+      socketUart.device = device;
+    }
+  };
+
+  const Config *_config;
+
+  // The traffic and the errors on the lines use separate generators, the same
+  // traffic runs with and without errors.
+  std::mt19937_64 _random;
+  std::mt19937_64 _line;
+  std::vector<std::unique_ptr<Node>> _nodes;
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> _events;
+  uint64_t _sequence{};
+
+  // The time the messages were sent, indexed by their sequence number.
+  std::vector<uint64_t> _sentNsec;
+
+  void schedule(Event event) {
+    event.sequence = _sequence++;
+    _events.push(event);
+  }
+
+  // The device runs loop() again after the current pass.
+  void scheduleLoop(uint16_t device) {
+    if (_nodes[device]->loopPending)
+      return;
+
+    _nodes[device]->loopPending = true;
+    schedule({simNsec + _config->loopNsec, Kind::Loop, device});
+  }
+
+  void loop(uint16_t device) {
+    Node *node = _nodes[device].get();
+    node->link->loop();
+    if (node->plugUart.available() > 0 || node->socketUart.available() > 0)
+      scheduleLoop(device);
+  }
+
+  void send() {
+    std::uniform_int_distribution<uint16_t> address(0, _config->devices - 1);
+    const uint32_t sequence = _sentNsec.size();
+    const uint8_t data[4]{(uint8_t)(sequence >> 24), (uint8_t)(sequence >> 16), (uint8_t)(sequence >> 8), (uint8_t)sequence};
+
+    V2MIDI::Packet midi;
+    midi.setData(data);
+    midi.setPort(address(_random));
+    if (!_nodes[0]->socket->send(&midi)) {
+      statistics.rejected++;
+      return;
+    }
+
+    _sentNsec.push_back(simNsec);
+    statistics.sent++;
+  }
+
+  void receive(V2Link::Packet *packet) {
+    V2MIDI::Packet midi;
+    if (!packet->receive(&midi))
+      return;
+
+    const uint8_t *data     = midi.getData();
+    const uint32_t sequence = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+    if (sequence >= _sentNsec.size())
+      return;
+
+    statistics.received++;
+    statistics.addLatency(simNsec - _sentNsec[sequence]);
+  }
+};
+
+size_t SimUart::write(const uint8_t *buffer, size_t size) {
+  if ((size_t)availableForWrite() < size)
+    size = availableForWrite();
+
+  chain->transmit(this, buffer, size);
+  return size;
+}
+
+static bool parseBauds(const char *text, std::vector<uint32_t> *bauds) {
+  bauds->clear();
+  for (const char *s = text; *s;) {
+    char *end;
+    const unsigned long baud = strtoul(s, &end, 10);
+    if (end == s || baud == 0)
+      return false;
+
+    bauds->push_back(baud);
+    s = *end == ',' ? end + 1 : end;
+  }
+
+  return !bauds->empty();
+}
+
+int main(int argc, char **argv) {
+  Config config{100, 16, 1000, 1000ULL * 1000 * 1000, 0, 5 * 1000, 0, 0, 0, 1};
+  std::vector<uint32_t> bauds{3000000};
+  unsigned threads = std::thread::hardware_concurrency();
+
+  for (int i = 1; i < argc; i++) {
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (!value || argv[i][0] != '-' || strlen(argv[i]) != 2) {
+      fprintf(stderr, "Usage: %s [-c chains] [-d devices] [-r rate] [-s seconds] [-b baud,...] [-l usec] [-i usec] [-p probability] [-x probability] [-j threads] [-S seed]\n", argv[0]);
+      return 1;
+    }
+
+    i++;
+    switch (argv[i - 1][1]) {
+      case 'c':
+        config.chains = strtoul(value, nullptr, 10);
+        break;
+
+      case 'd':
+        config.devices = strtoul(value, nullptr, 10);
+        break;
+
+      case 'r':
+        config.rate = strtoul(value, nullptr, 10);
+        break;
+
+      case 's':
+        config.durationNsec = strtod(value, nullptr) * 1e9;
+        break;
+
+      case 'b':
+        if (!parseBauds(value, &bauds)) {
+          fprintf(stderr, "Invalid baud rates: %s\n", value);
+          return 1;
+        }
+        break;
+
+      case 'l':
+        config.loopNsec = strtod(value, nullptr) * 1000;
+        break;
+
+      case 'i':
+        config.isrNsec = strtod(value, nullptr) * 1000;
+        break;
+
+      case 'p':
+        config.loss = strtod(value, nullptr);
+        break;
+
+      case 'x':
+        config.corruption = strtod(value, nullptr);
+        break;
+
+      case 'j':
+        threads = strtoul(value, nullptr, 10);
+        break;
+
+      case 'S':
+        config.seed = strtoull(value, nullptr, 10);
+        break;
+
+      default:
+        fprintf(stderr, "Unknown option: %s\n", argv[i - 1]);
+        return 1;
+    }
+  }
+
+  if (config.chains == 0 || config.devices == 0 || config.devices > V2Link::maxAddress || config.rate == 0) {
+    fprintf(stderr, "Invalid configuration\n");
+    return 1;
+  }
+
+  for (const uint32_t baud : bauds) {
+    config.baud = baud;
+
+    std::vector<Statistics> results(config.chains);
+    std::vector<std::function<void()>> tasks;
+    for (uint32_t i = 0; i < config.chains; i++)
+      tasks.push_back([&config, &results, i]() {
+        Chain chain(&config, i);
+        chain.run();
+        results[i] = std::move(chain.statistics);
+      });
+
+    const auto start = std::chrono::steady_clock::now();
+    Pool pool(threads);
+    pool.run(std::move(tasks));
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    Statistics total;
+    for (const auto &result : results)
+      total.add(result);
+
+    const double seconds = config.durationNsec / 1e9;
+    printf("%u baud, %u chains of %u devices, %.3f s\n", baud, config.chains, config.devices, seconds);
+    printf("  messages:   %llu sent, %llu received, %llu rejected, %llu lost\n",
+           (unsigned long long)total.sent,
+           (unsigned long long)total.received,
+           (unsigned long long)total.rejected,
+           (unsigned long long)(total.sent - total.received));
+    printf("  throughput: %.0f messages/s\n", total.received / seconds);
+    printf("  latency:    p50 %u µs, p99 %u µs, max %.0f µs\n",
+           total.getPercentile(0.5),
+           total.getPercentile(0.99),
+           total.maxLatencyNsec / 1e3);
+    printf("  errors:     %llu bytes lost, %llu bytes corrupted, %llu frames dropped\n",
+           (unsigned long long)total.lost,
+           (unsigned long long)total.corrupted,
+           (unsigned long long)total.frameErrors);
+    printf("  digest:     %016llx\n", (unsigned long long)total.digest);
+    printf("  simulation: %llu events in %.2f s, %.1f M events/s, %u threads\n",
+           (unsigned long long)total.events,
+           wall,
+           total.events / wall / 1e6,
+           threads);
+  }
+
+  return 0;
+}
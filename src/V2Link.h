@@ -4,22 +4,51 @@
 #pragma once
 
 // V2 Link devices are full-duplex LVDS serial lines. The impedance is ~120 Ohm,
-// the baud rate is 3 Mhz.
+// the default baud rate is 3 Mhz.
 //
 // The 'plug' connects the device to the parent device, the 'socket' connects
-// the children devices. Up to 16 devices can be daisy-chained.
+// the children devices. Up to 16 devices can be daisy-chained, longer chains
+// use extended frames with an 8 bit address.
+//
+// A hub device can have several sockets, every socket is a branch which serves a
+// range of addresses. The devices are connected as a tree with fewer hops between
+// the root and the leaves.
 
 #include <Arduino.h>
 #include <V2MIDI.h>
 
+// The clock in microseconds. Hosts and simulations can provide their own time
+// source, e.g. -DV2LINK_MICROS=simMicros.
+#ifndef V2LINK_MICROS
+#define V2LINK_MICROS micros
+#endif
+
 class V2Link {
 public:
   // Header:
   //   4 bit: target/child address,
   //   4 bit: message type
+  //
+  // Extended header, for the addresses beyond 15:
+  //   4 bit: message type
+  //   4 bit: 0x0f
+  //   8 bit: target/child address
+  //
+  // Extended frames are only sent to or from devices which are further away than
+  // 15 hops; only the devices which forward them need to support them.
+  //
+  // The types up to 11 are framed; the ones which are not known are forwarded
+  // like any other message, but not passed to the application. The types 12 to
+  // 15 indicate a misaligned stream. Devices which predate 'Announce' resync on
+  // its frames.
   class Packet : public V2MIDI::Transport {
   public:
-    enum class Type : uint8_t { MIDI, Pulse };
+    enum class Type : uint8_t { MIDI, Pulse, Bulk, BulkData, Firmware, Time, Schedule, Link, Announce };
+
+    static constexpr uint8_t maxType = (uint8_t)Type::Announce;
+
+    // The types reserved for future messages.
+    static constexpr uint8_t maxFrameType = 11;
 
     // Solenoid pulse:
     //   12 bit: watts
@@ -34,54 +63,87 @@ public:
       bool fadeOut;
     };
 
+    // Solenoid pulse in integer units, decoded without floating point math.
+    struct PulseFixed {
+      uint8_t port;
+      uint32_t milliwatts;
+      uint32_t usec;
+      bool fadeIn;
+      bool fadeOut;
+    };
+
     Type getType() const {
-      return static_cast<Type>(_data[0] & 0x0f);
+      return static_cast<Type>(_type);
     }
 
     uint8_t getAddress() const {
-      return _data[0] >> 4;
+      return _address;
     }
 
     bool receive(V2MIDI::Packet *midi) {
       if (getType() != Packet::Type::MIDI)
         return false;
 
-      midi->setData(_data + 1);
+      midi->setData(_data);
       return true;
     }
 
     bool send(V2MIDI::Packet *midi) {
-      _data[0] = (uint8_t)Packet::Type::MIDI;
-      memcpy(_data + 1, midi->getData(), 4);
+      _type = (uint8_t)Packet::Type::MIDI;
+      memcpy(_data, midi->getData(), 4);
       return true;
     }
 
     void getPulse(Pulse *pulse) {
-      pulse->port    = _data[1] & 0x0f;
-      pulse->fadeIn  = _data[1] & (1 << 4);
-      pulse->fadeOut = _data[1] & (1 << 5);
+      pulse->port    = _data[0] & 0x0f;
+      pulse->fadeIn  = _data[0] & (1 << 4);
+      pulse->fadeOut = _data[0] & (1 << 5);
 
       {
-        uint16_t map = (_data[2] >> 4) << 8;
-        map |= _data[3];
+        uint16_t map = (_data[1] >> 4) << 8;
+        map |= _data[2];
         const float fraction = (float)map / 4095.f;
         pulse->watts         = 100.f * powf(fraction, 3);
       }
       {
-        uint16_t map = (_data[2] & 0x0f) << 8;
-        map |= _data[4];
+        uint16_t map = (_data[1] & 0x0f) << 8;
+        map |= _data[3];
         const float fraction = (float)map / 4095.f;
         pulse->seconds       = 100.f * powf(fraction, 8);
       }
     }
 
+    void getPulse(PulseFixed *pulse) const {
+      pulse->port    = _data[0] & 0x0f;
+      pulse->fadeIn  = _data[0] & (1 << 4);
+      pulse->fadeOut = _data[0] & (1 << 5);
+
+      // The fractions in 24 bit fixed point.
+      {
+        uint16_t map = (_data[1] >> 4) << 8;
+        map |= _data[2];
+        const uint64_t fraction = ((uint64_t)map << 24) / 4095;
+        const uint64_t cube     = (((fraction * fraction) >> 24) * fraction) >> 24;
+        pulse->milliwatts       = (cube * 100 * 1000) >> 24;
+      }
+      {
+        uint16_t map = (_data[1] & 0x0f) << 8;
+        map |= _data[3];
+        const uint64_t fraction = ((uint64_t)map << 24) / 4095;
+        const uint64_t square   = (fraction * fraction) >> 24;
+        const uint64_t fourth   = (square * square) >> 24;
+        const uint64_t eighth   = (fourth * fourth) >> 24;
+        pulse->usec             = (eighth * 100 * 1000 * 1000) >> 24;
+      }
+    }
+
     void setPulse(const Packet::Pulse *pulse) {
-      _data[0] = (uint8_t)Packet::Type::Pulse;
-      _data[1] = pulse->port & 0x0f;
+      _type    = (uint8_t)Packet::Type::Pulse;
+      _data[0] = pulse->port & 0x0f;
       if (pulse->fadeIn)
-        _data[1] |= 1 << 4;
+        _data[0] |= 1 << 4;
       if (pulse->fadeOut)
-        _data[1] |= 1 << 5;
+        _data[0] |= 1 << 5;
 
       {
         float watts = pulse->watts;
@@ -90,8 +152,8 @@ public:
 
         const float fraction = watts / 100.f;
         const uint16_t map   = powf(fraction, 1.f / 3.f) * 4095.f;
-        _data[2]             = (map >> 8) << 4;
-        _data[3]             = map & 0xff;
+        _data[1]             = (map >> 8) << 4;
+        _data[2]             = map & 0xff;
       }
       {
         float seconds = pulse->seconds;
@@ -100,178 +162,2198 @@ public:
 
         const float fraction = seconds / 100.f;
         const uint16_t map   = powf(fraction, 1.f / 8.f) * 4095.f;
-        _data[2] |= map >> 8;
-        _data[4] = map & 0xff;
+        _data[1] |= map >> 8;
+        _data[3] = map & 0xff;
       }
     }
 
   private:
     friend class V2Link;
-    uint8_t _data[5];
+    // The payload is word-aligned, it is copied with single word operations. The
+    // header is packed and unpacked only by the ports.
+    alignas(4) uint8_t _data[4];
+    uint8_t _type{};
+    uint8_t _address{};
+
+    void setAddress(uint8_t address) {
+      _address = address;
+    }
+
+    uint32_t getValue() const {
+      return ((uint32_t)_data[0] << 24) | (_data[1] << 16) | (_data[2] << 8) | _data[3];
+    }
+
+    void setValue(uint32_t value) {
+      _data[0] = value >> 24;
+      _data[1] = value >> 16;
+      _data[2] = value >> 8;
+      _data[3] = value;
+    }
   };
 
-  class Port : public V2MIDI::Transport {
+  // Renders solenoid pulses into PWM duty cycles. The power of a pulse is
+  // converted to a duty cycle relative to the power of the solenoid at the full
+  // duty cycle. 'Fade in' ramps the power up over the duration of the pulse,
+  // 'fade out' ramps it down; with both, the ramp peaks at half of the duration.
+  //
+  // A fixed number of pulses is rendered at the same time, a new pulse replaces
+  // the current pulse of the same port, or the pulse closest to its end. tick() is
+  // called periodically, from a timer interrupt or the main loop; setDuty() is
+  // called for every change of a duty cycle. If tick() runs in an interrupt,
+  // start() and stop() need to be called with the interrupt disabled.
+  //
+  // An optional power budget limits the sum of the power of all pulses to the
+  // capacity of the power supply. A pulse which does not fit is delayed until
+  // enough power is available, which staggers the pulses of a dense chord. After
+  // the maximum delay, it is started with its power reduced to the remaining
+  // budget.
+  class Envelope {
   public:
+    static constexpr uint8_t maxVoices  = 8;
+    static constexpr uint8_t maxPending = 8;
+
     struct {
-      uint32_t input{};
-      uint32_t output{};
+      uint32_t deferred{};
+      uint32_t scaled{};
+      uint32_t dropped{};
     } statistics;
 
-    constexpr Port(Uart *uart, uint8_t pinTx = 0) : _uart(uart), _pinTx(pinTx) {}
+    Envelope(uint16_t maxDuty, uint32_t milliwatts) : _maxDuty(maxDuty) {
+      for (uint8_t i = 0; i < 16; i++)
+        _milliwatts[i] = milliwatts;
+    }
 
-    void begin() {
-      _uart->begin(3000000);
-      _uart->setTimeout(1);
+    // The power of the solenoid connected to the port at the full duty cycle.
+    void setPower(uint8_t port, uint32_t milliwatts) {
+      _milliwatts[port & 0x0f] = milliwatts;
+    }
 
-      if (_pinTx > 0) {
-        pinMode(_pinTx, OUTPUT);
-        digitalWrite(_pinTx, HIGH);
+    // The capacity of the power supply and the maximum delay of a pulse. A budget
+    // of 0 disables the limit.
+    void setBudget(uint32_t milliwatts, uint32_t delayUsec) {
+      _budget.milliwatts = milliwatts;
+      _budget.delayUsec  = delayUsec;
+    }
+
+    void start(const Packet::PulseFixed *pulse, uint32_t usec) {
+      // The power is only known for the ports 0 to 15.
+      if (pulse->port > 0x0f)
+        return;
+
+      stop(pulse->port);
+      if (pulse->milliwatts == 0 || pulse->usec == 0 || _milliwatts[pulse->port] == 0)
+        return;
+
+      if (fits(pulse)) {
+        play(pulse, usec);
+        return;
       }
+
+      if (_budget.delayUsec > 0 && _budget.count < maxPending) {
+        _budget.pending[_budget.count].pulse = *pulse;
+        _budget.pending[_budget.count].usec  = usec;
+        _budget.count++;
+        statistics.deferred++;
+        return;
+      }
+
+      playReduced(pulse, usec);
     }
 
-    bool idle() const {
-      return !_active;
+    void stop(uint8_t port) {
+      for (uint8_t i = 0; i < _budget.count; i++) {
+        if (_budget.pending[i].pulse.port != port)
+          continue;
+
+        removePending(i);
+        break;
+      }
+
+      for (uint8_t i = 0; i < maxVoices; i++) {
+        if (_voices[i].active && _voices[i].port == port)
+          release(_voices + i);
+      }
     }
 
-    bool receive(Packet *packet) {
-      if (_uart->available() == 0)
-        return false;
+    void tick(uint32_t usec) {
+      for (uint8_t i = 0; i < maxVoices; i++) {
+        Voice *voice = _voices + i;
+        if (!voice->active)
+          continue;
 
-      _usec = micros();
+        const uint32_t t = (usec - voice->startUsec) >> voice->shift;
+        if (t >= voice->length) {
+          release(voice);
+          continue;
+        }
 
-      // Drop partial messages which don't complete in time.
-      if (_uart->available() < 5) {
-        if (_timeoutUsec == 0)
-          _timeoutUsec = micros();
+        uint32_t duty = voice->target;
+        if (voice->fadeIn && voice->fadeOut) {
+          const uint32_t half = voice->length > 1 ? voice->length / 2 : 1;
+          duty                = duty * (t < half ? t : voice->length - t) / half;
 
-        if ((unsigned long)(micros() - _timeoutUsec) > 100) {
-          while (_uart->available())
-            _uart->read();
+        } else if (voice->fadeIn)
+          duty = duty * t / voice->length;
 
-          _timeoutUsec = 0;
+        else if (voice->fadeOut)
+          duty = duty * (voice->length - t) / voice->length;
+
+        if (duty > voice->target)
+          duty = voice->target;
+
+        if (duty == voice->duty)
+          continue;
+
+        voice->duty = duty;
+        setDuty(voice->port, duty);
+      }
+
+      // Start the delayed pulses in the order of their arrival.
+      for (uint8_t i = 0; i < _budget.count;) {
+        const Packet::PulseFixed pulse = _budget.pending[i].pulse;
+
+        if (fits(&pulse)) {
+          removePending(i);
+          play(&pulse, usec);
+          continue;
         }
 
-        return false;
+        if ((uint32_t)(usec - _budget.pending[i].usec) >= _budget.delayUsec) {
+          removePending(i);
+          playReduced(&pulse, usec);
+          continue;
+        }
+
+        i++;
       }
+    }
 
-      _timeoutUsec = 0;
-      _uart->readBytes(packet->_data, 5);
-      statistics.input++;
+    uint8_t countVoices() const {
+      uint8_t count = 0;
+      for (uint8_t i = 0; i < maxVoices; i++)
+        if (_voices[i].active)
+          count++;
 
-      return true;
+      return count;
     }
 
-    bool send(uint8_t address, Packet *packet) {
-      if (!_active) {
-        if (_pinTx > 0)
-          digitalWrite(_pinTx, HIGH);
+    // The sum of the peak power of all playing pulses.
+    uint32_t getMilliwatts() const {
+      return _budget.active;
+    }
 
-        _active = true;
+  protected:
+    virtual void setDuty(uint8_t port, uint16_t duty) = 0;
+
+  private:
+    const uint16_t _maxDuty;
+    uint32_t _milliwatts[16];
+
+    struct Voice {
+      bool active;
+      uint8_t port;
+      bool fadeIn;
+      bool fadeOut;
+      uint8_t shift;
+      uint32_t startUsec;
+      uint32_t length;
+      uint32_t milliwatts;
+      uint16_t target;
+      uint16_t duty;
+    } _voices[maxVoices]{};
+
+    struct {
+      uint32_t milliwatts;
+      uint32_t delayUsec;
+      uint32_t active;
+
+      struct {
+        Packet::PulseFixed pulse;
+        uint32_t usec;
+      } pending[maxPending];
+      uint8_t count;
+    } _budget{};
+
+    // The power of the pulse, limited by the power of the solenoid.
+    uint32_t getMilliwatts(const Packet::PulseFixed *pulse) const {
+      return pulse->milliwatts < _milliwatts[pulse->port] ? pulse->milliwatts : _milliwatts[pulse->port];
+    }
+
+    bool fits(const Packet::PulseFixed *pulse) const {
+      if (_budget.milliwatts == 0)
+        return true;
+
+      return _budget.active + getMilliwatts(pulse) <= _budget.milliwatts;
+    }
+
+    void removePending(uint8_t index) {
+      _budget.count--;
+      for (uint8_t i = index; i < _budget.count; i++)
+        _budget.pending[i] = _budget.pending[i + 1];
+    }
+
+    void playReduced(const Packet::PulseFixed *pulse, uint32_t usec) {
+      if (_budget.active >= _budget.milliwatts) {
+        statistics.dropped++;
+        return;
       }
 
-      _usec = micros();
+      Packet::PulseFixed reduced = *pulse;
+      reduced.milliwatts         = _budget.milliwatts - _budget.active;
+      statistics.scaled++;
+      play(&reduced, usec);
+    }
 
-      if (_uart->availableForWrite() < 5)
-        return false;
+    void play(const Packet::PulseFixed *pulse, uint32_t usec) {
+      Voice *voice = allocate(usec);
 
-      uint8_t header = address << 4;
-      header |= packet->_data[0] & 0x0f;
-      _uart->write(header);
-      _uart->write(packet->_data + 1, 4);
-      statistics.output++;
+      const uint32_t milliwatts = getMilliwatts(pulse);
+      const uint16_t duty       = (uint64_t)milliwatts * _maxDuty / _milliwatts[pulse->port];
 
-      return true;
+      // Scale the time to fit into 16 bits, the duty cycles are calculated with
+      // 32 bit multiplications.
+      uint8_t shift = 0;
+      while ((pulse->usec >> shift) > 0xffff)
+        shift++;
+
+      voice->active     = true;
+      voice->port       = pulse->port;
+      voice->fadeIn     = pulse->fadeIn;
+      voice->fadeOut    = pulse->fadeOut;
+      voice->shift      = shift;
+      voice->startUsec  = usec;
+      voice->length     = pulse->usec >> shift;
+      voice->milliwatts = milliwatts;
+      if (voice->length == 0)
+        voice->length = 1;
+
+      voice->target = duty;
+      voice->duty   = 0;
+      _budget.active += milliwatts;
+      tick(usec);
     }
 
-    bool receive(V2MIDI::Packet *midi) {
-      return false;
+    void release(Voice *voice) {
+      voice->active = false;
+      _budget.active -= voice->milliwatts;
+      if (voice->duty > 0)
+        setDuty(voice->port, 0);
     }
 
-    bool send(V2MIDI::Packet *midi) {
-      Packet packet;
-      packet._data[0] = (uint8_t)Packet::Type::MIDI;
-      memcpy(packet._data + 1, midi->getData(), 4);
-      return send(midi->getPort(), &packet);
+    // Steal the voice with the least remaining time.
+    Voice *allocate(uint32_t usec) {
+      Voice *voice       = nullptr;
+      uint32_t remaining = 0xffffffff;
+
+      for (uint8_t i = 0; i < maxVoices; i++) {
+        if (!_voices[i].active)
+          return _voices + i;
+
+        const uint32_t elapsed = (usec - _voices[i].startUsec) >> _voices[i].shift;
+        const uint32_t left =
+          (elapsed < _voices[i].length ? _voices[i].length - elapsed : 0) << _voices[i].shift;
+        if (left < remaining) {
+          remaining = left;
+          voice     = _voices + i;
+        }
+      }
+
+      release(voice);
+      return voice;
     }
+  };
+
+  // Bulk messages are split into frames. The 'Bulk' frame starts a message:
+  //    8 bit: tag
+  //   16 bit: length
+  //    8 bit: checksum, the sum of all data bytes
+  //
+  // It is followed by 'BulkData' frames, carrying 4 bytes of data each; the last
+  // frame is padded. The frames are forwarded by every hop without buffering, the
+  // receiving device reassembles the data in a buffer provided by the application.
+  //
+  // Only one message per direction is reassembled at a time; a 'Bulk' frame drops
+  // an incomplete message.
+  class Bulk {
+  public:
+    struct {
+      uint32_t input{};
+      uint32_t error{};
+    } statistics;
+
+    constexpr Bulk(uint8_t *buffer, uint16_t size) : _buffer(buffer), _size(size) {}
 
   private:
     friend class V2Link;
-    Uart *_uart;
-    const uint8_t _pinTx;
+    uint8_t *const _buffer;
+    const uint16_t _size;
     bool _active{};
-    unsigned long _timeoutUsec{};
-    unsigned long _usec{};
+    uint8_t _address{};
+    uint8_t _tag{};
+    uint8_t _checksum{};
+    uint16_t _length{};
+    uint16_t _position{};
 
-    void powerDown() {
-      if (!_active)
+    // Returns true when a complete message is in the buffer.
+    bool receive(const Packet *packet) {
+      switch (packet->getType()) {
+        case Packet::Type::Bulk:
+          if (_active)
+            statistics.error++;
+
+          _active   = false;
+          _address  = packet->getAddress();
+          _tag      = packet->_data[0];
+          _length   = (packet->_data[1] << 8) | packet->_data[2];
+          _checksum = packet->_data[3];
+          _position = 0;
+
+          if (_length == 0 || _length > _size) {
+            statistics.error++;
+            return false;
+          }
+
+          _active = true;
+          return false;
+
+        case Packet::Type::BulkData: {
+          if (!_active || packet->getAddress() != _address)
+            return false;
+
+          uint16_t n = _length - _position;
+          if (n > 4)
+            n = 4;
+
+          memcpy(_buffer + _position, packet->_data, n);
+          _position += n;
+          if (_position < _length)
+            return false;
+
+          _active     = false;
+          uint8_t sum = 0;
+          for (uint16_t i = 0; i < _length; i++)
+            sum += _buffer[i];
+
+          if (sum != _checksum) {
+            statistics.error++;
+            return false;
+          }
+
+          statistics.input++;
+          return true;
+        }
+
+        default:
+          return false;
+      }
+    }
+  };
+
+  // Messages to the broadcast address are forwarded to all child devices, and
+  // received by every device.
+  static constexpr uint8_t broadcastAddress = 0xff;
+  static constexpr uint8_t maxAddress       = 0xfe;
+
+  // Firmware images are broadcast as a series of bulk messages, every device
+  // writes the blocks while they are forwarded to the next device. All devices in
+  // the chain receive the image at the same time; the sender pauses between the
+  // blocks to give the devices time to write to the flash.
+  //
+  // The bulk message of a block carries the 32 bit offset of the block, followed
+  // by the data. The 'Firmware' frame finishes the update, every device replies
+  // with its status:
+  //    8 bit: command
+  //   24 bit: size of the image
+  //
+  // The tag 0xff is reserved for the firmware blocks, the applications cannot
+  // send bulk messages with it.
+  static constexpr uint8_t firmwareTag = 0xff;
+  enum class Firmware : uint8_t { Finish, Success, Failure };
+
+  // Maps the logical IDs of the child devices to their addresses, the address
+  // passed to receiveSocket(). Applications address the devices by their ID,
+  // the devices can be connected in any order.
+  //
+  // A device announces its ID to the parent devices with an 'Announce' frame,
+  // the ID is in the first data byte. The routes are learned from the frames,
+  // or set by the application. The routes of a branch are dropped when a device
+  // is attached to it.
+  class Routes {
+  public:
+    constexpr Routes(bool learn = true) : _learn(learn) {}
+
+    // Returns false for an unknown ID. There is no invalid address to return
+    // instead, 0xff is the broadcastAddress.
+    bool getAddress(uint8_t id, uint8_t *address) const {
+      if (_address[id] == 0)
+        return false;
+
+      *address = _address[id] - 1;
+      return true;
+    }
+
+    bool getId(uint8_t address, uint8_t *id) const {
+      if (_id[address] == 0)
+        return false;
+
+      *id = _id[address] - 1;
+      return true;
+    }
+
+    void set(uint8_t id, uint8_t address) {
+      if (id == broadcastAddress || address > maxAddress)
         return;
 
-      // Wait for at least 100ms to flush a large outgoing buffer.
-      if ((unsigned long)(micros() - _usec) < 100 * 1000)
+      remove(id);
+      if (_id[address] > 0)
+        _address[_id[address] - 1] = 0;
+
+      _address[id] = address + 1;
+      _id[address] = id + 1;
+    }
+
+    void remove(uint8_t id) {
+      if (_address[id] == 0)
         return;
 
-      if (_pinTx > 0)
-        digitalWrite(_pinTx, LOW);
+      _id[_address[id] - 1] = 0;
+      _address[id]          = 0;
+    }
 
-      _active = false;
+    void clear() {
+      memset(_address, 0, sizeof(_address));
+      memset(_id, 0, sizeof(_id));
+    }
+
+  private:
+    friend class V2Link;
+    const bool _learn;
+
+    // The values are stored + 1, 0 is an empty entry.
+    uint8_t _address[256]{};
+    uint8_t _id[256]{};
+
+    void remove(uint8_t first, uint8_t last) {
+      for (uint16_t address = first; address <= last; address++)
+        if (_id[address] > 0)
+          remove(_id[address] - 1);
     }
   };
 
-  constexpr V2Link(Port *port_, Port *socket_) : plug(port_), socket(socket_) {}
+  // Records the bytes sent and received by the ports into a ring buffer provided
+  // by the application; the oldest entries are overwritten. The plug is port 0,
+  // the branches follow in their order. The input which is not part of a frame,
+  // noise or a partial frame, is recorded as 'Drop', the start of a resync as
+  // 'Resync'; the raw input of a port is the sequence of 'Receive' and 'Drop'.
+  //
+  // The dump starts with the magic "V2LT", followed by the entries of 16 bytes:
+  //   32 bit: time in microseconds, little-endian
+  //    8 bit: port
+  //    8 bit: event
+  //    8 bit: number of bytes
+  //    8 bit: 0
+  //   64 bit: bytes, a frame or up to 8 dropped bytes
+  class Trace {
+  public:
+    enum class Event : uint8_t { Receive, Send, Drop, Resync };
 
-  void begin() {
-    if (plug)
-      plug->begin();
+    struct Entry {
+      uint32_t usec;
+      uint8_t port;
+      Event event;
+      uint8_t length;
+      uint8_t bytes[8];
 
-    if (socket)
-      socket->begin();
-  }
+      // The header fields of a 'Receive' or 'Send' frame.
+      uint8_t getType() const {
+        return (bytes[0] & 0x0f) == 0x0f ? bytes[0] >> 4 : bytes[0] & 0x0f;
+      }
 
-  void loop() {
-    Packet packet;
+      uint8_t getAddress() const {
+        return (bytes[0] & 0x0f) == 0x0f ? bytes[1] : bytes[0] >> 4;
+      }
+    };
 
-    if (plug) {
-      if (plug->receive(&packet)) {
-        if (packet.getAddress() > 0) {
-          // Forward message from a parent device to a child device.
-          if (socket)
-            socket->send(packet.getAddress() - 1, &packet);
+    // A trace without entries is not recorded.
+    constexpr Trace(Entry *entries, uint16_t size) : _entries(entries), _size(size) {}
+
+    uint16_t count() const {
+      return _count;
+    }
+
+    // The entries in the order they were recorded, 0 is the oldest one.
+    const Entry *get(uint16_t index) const {
+      if (index >= _count)
+        return nullptr;
+
+      return &_entries[(_position + _size - _count + index) % _size];
+    }
+
+    void clear() {
+      _position = 0;
+      _count    = 0;
+    }
+
+    void dump(Print *print) const {
+      print->write((const uint8_t *)"V2LT", 4);
+
+      for (uint16_t i = 0; i < _count; i++) {
+        const Entry *entry = get(i);
+        uint8_t bytes[16]{
+          (uint8_t)entry->usec,
+          (uint8_t)(entry->usec >> 8),
+          (uint8_t)(entry->usec >> 16),
+          (uint8_t)(entry->usec >> 24),
+          entry->port,
+          (uint8_t)entry->event,
+          entry->length,
+        };
+        memcpy(bytes + 8, entry->bytes, entry->length);
+        print->write(bytes, sizeof(bytes));
+      }
+    }
+
+  private:
+    friend class V2Link;
+    Entry *const _entries;
+    const uint16_t _size;
+    uint16_t _position{};
+    uint16_t _count{};
+
+    void record(uint32_t usec, uint8_t port, Event event, const uint8_t *bytes, uint8_t length) {
+      if (_size == 0)
+        return;
+
+      Entry *entry  = &_entries[_position];
+      entry->usec   = usec;
+      entry->port   = port;
+      entry->event  = event;
+      entry->length = length;
+      if (length > 0)
+        memcpy(entry->bytes, bytes, length);
+
+      _position = (_position + 1) % _size;
+      if (_count < _size)
+        _count++;
+    }
+  };
+
+  class Port : public V2MIDI::Transport {
+  public:
+    // The timing of the port. The timeout for a partial frame is derived from the
+    // baud rate, unless it is specified.
+    //
+    // If both ends of a link support a higher baud rate than the one the link is
+    // started with, the parent device switches the link to the highest common
+    // rate. A rate which is not confirmed in time, or which causes errors, falls
+    // back to the initial rate and the next lower rate is tried.
+    struct Timing {
+      uint32_t baud;
+
+      // The range of the idle time before the TX line driver is powered down.
+      uint32_t powerDownMinUsec;
+      uint32_t powerDownMaxUsec;
+
+      // The highest supported rate, 0 disables the negotiation.
+      uint32_t maxBaud;
 
-        } else
-          receivePlug(&packet);
+      // The interval of the keepalive messages, 0 disables the supervision.
+      uint32_t keepaliveUsec;
+
+      // The time a partial frame has to complete. USB serial adapters deliver
+      // the data in packets, a frame can be split across them.
+      uint32_t frameTimeoutUsec;
+    };
+
+    // A port with keepalives or the negotiation enabled sends an 'Attach' message
+    // when it starts, the other end of the link restarts the negotiation and drops
+    // its state of the link. Both features require the other end to support the
+    // 'Link' frames. Noise while a cable is plugged in, or frames with an invalid
+    // type, are dropped until the line has been idle for the time of a partial
+    // frame. Without a gap in the stream, the bytes are skipped until the next
+    // valid header.
+    //
+    // The state of the link, supervised with keepalive messages and the error
+    // counters. A link without messages for three keepalive intervals is down,
+    // the UART is reset and the buffers are flushed. A link with errors in the
+    // last interval is degraded. Keepalives are only sent after the other end has
+    // sent a message; an empty or unplugged socket stays silent.
+    enum class State : uint8_t { Down, Degraded, Up };
+
+    struct {
+      uint32_t input{};
+      uint32_t output{};
+
+      // Dropped partial frames.
+      uint32_t error{};
+
+      // The power transitions of the TX line driver.
+      uint32_t wake{};
+      uint32_t sleep{};
+    } statistics;
+
+    constexpr Port(Uart *uart, uint8_t pinTx = 0) : Port(uart, pinTx, {3000000, 1000, 100 * 1000, 0, 0, 0}) {}
+    constexpr Port(Uart *uart, uint8_t pinTx, Timing timing) : _uart(uart), _pinTx(pinTx), _timing(timing) {}
+
+    void begin() {
+      _uart->setTimeout(1);
+      setBaud(_timing.baud);
+      _txSize       = _uart->availableForWrite();
+      _intervalUsec = _timing.powerDownMaxUsec;
+
+      if (_pinTx > 0) {
+        pinMode(_pinTx, OUTPUT);
+        digitalWrite(_pinTx, HIGH);
       }
 
-      plug->powerDown();
+      // Skip the noise up to the first valid header, without waiting for a gap;
+      // the 'Attach' of a device which starts at the same time follows
+      // immediately, and without it neither end would send keepalives.
+      drop();
+      _resync.search = true;
+      if (_timing.keepaliveUsec > 0 || _timing.maxBaud > 0)
+        sendLink(Link::Attach, _baud);
+    }
+
+    bool idle() const {
+      return !_active;
+    }
+
+    uint32_t getBaud() const {
+      return _baud;
+    }
+
+    State getState() const {
+      return _health.state;
+    }
+
+    // The time of the current loop() pass, the clock is read once per pass.
+    unsigned long getUsec() const {
+      return _pass ? _passUsec : V2LINK_MICROS();
     }
 
-    if (socket) {
-      if (socket->receive(&packet)) {
-        // Forward message from a child device towards the parent device, stop after
-        // too many hops.
-        if (plug && packet.getAddress() < 0x0f)
-          plug->send(packet.getAddress() + 1, &packet);
+    bool receive(Packet *packet) {
+      if (_parked.pending) {
+        // The message waits for the MIDI receive.
+        if (_parked.transport)
+          return false;
 
-        receiveSocket(&packet);
+        packet->_type    = _parked.type;
+        packet->_address = _parked.address;
+        memcpy(packet->_data, _parked.data, 4);
+        _delivered = _parked.delivered;
+        _parked    = {};
+        return true;
       }
 
-      socket->powerDown();
+      _delivered = false;
+      return read(packet);
     }
-  }
 
-  bool idle() const {
-    if (plug && !plug->idle())
-      return false;
+    bool send(uint8_t address, Packet *packet) {
+      return send(address, packet->_type, packet->_data);
+    }
 
-    if (socket && !socket->idle())
-      return false;
+    // Receive the MIDI messages for this device, to use the port as a MIDI
+    // transport; the address is the port of the MIDI packet. The frames are
+    // received in order, a frame of another type or address is left for
+    // receive(Packet *), and the MIDI messages behind it wait until it is
+    // received. A broadcast is returned and also passed to receive(Packet *), to
+    // forward it to the children devices. The message after a 'Schedule' frame
+    // is left for receive(Packet *).
+    //
+    // Without the transport mode, a MIDI message which is read by V2Link::loop()
+    // first is passed to receivePlug(). In the transport mode, loop() leaves the
+    // MIDI messages for this device, and the scheduled ones when they are due, to
+    // this receive. The transport stops at the first frame which is not a MIDI
+    // message, like the 'Attach' of the parent; loop() needs to run for the same
+    // port to receive it.
+    void setMIDITransport(bool transport) {
+      _transport = transport;
+    }
 
-    return true;
-  }
+    bool receive(V2MIDI::Packet *midi) {
+      if (_parked.pending && _parked.transport) {
+        midi->setData(_parked.data);
+        midi->setPort(_parked.address);
+        _parked = {};
+        return true;
+      }
 
-  Port *plug{};
-  Port *socket{};
+      if (_parked.pending || _hold)
+        return false;
 
-protected:
-  virtual void receivePlug(Packet *packet) {}
-  virtual void receiveSocket(Packet *packet) {}
+      // Leave the frames which are not a MIDI message in the input, an
+      // extended header needs to be read to see the address.
+      if (!_resync.active && !_resync.search && _uart->available() > 0) {
+        const uint8_t header = _uart->peek();
+        if (header != (uint8_t)Packet::Type::MIDI && header != (((uint8_t)Packet::Type::MIDI << 4) | extendedType))
+          return false;
+      }
+
+      Packet packet;
+      if (!read(&packet))
+        return false;
+
+      const bool local     = packet._address == 0;
+      const bool broadcast = packet._address == broadcastAddress;
+      if (packet.getType() != Packet::Type::MIDI || (!local && !broadcast)) {
+        park(&packet, false);
+        return false;
+      }
+
+      if (broadcast)
+        park(&packet, true);
+
+      midi->setData(packet._data);
+      midi->setPort(packet._address);
+      return true;
+    }
+
+    // The MIDI data is written from the packet of the application, without an
+    // intermediate link packet.
+    bool send(V2MIDI::Packet *midi) {
+      return send(midi->getPort(), (uint8_t)Packet::Type::MIDI, midi->getData());
+    }
+
+  private:
+    friend class V2Link;
+    // The type value which escapes the extended header.
+    static constexpr uint8_t extendedType = 0x0f;
+
+    // The frame read by the MIDI receive, which is not a MIDI message for this
+    // device, or a broadcast which needs to be forwarded. In the transport mode,
+    // a MIDI message read by loop() for the MIDI receive.
+    struct {
+      bool pending;
+      bool delivered;
+      bool transport;
+      uint8_t type;
+      uint8_t address;
+      alignas(4) uint8_t data[4];
+    } _parked{};
+
+    // The last frame returned by receive(Packet *) was a broadcast which the MIDI
+    // receive has already returned.
+    bool _delivered{};
+
+    // A 'Schedule' frame was received, the next message belongs to it.
+    bool _hold{};
+
+    // The MIDI messages for this device are left to the MIDI receive.
+    bool _transport{};
+
+    void park(const Packet *packet, bool delivered, bool transport = false) {
+      _parked.pending   = true;
+      _parked.delivered = delivered;
+      _parked.transport = transport;
+      _parked.type      = packet->_type;
+      _parked.address   = packet->_address;
+      memcpy(_parked.data, packet->_data, 4);
+    }
+
+    static bool isHeader(uint8_t header) {
+      const bool extended = (header & 0x0f) == extendedType;
+      return (extended ? header >> 4 : header & 0x0f) <= Packet::maxFrameType;
+    }
+
+    bool read(Packet *packet) {
+      if (_resync.active) {
+        // A continuous stream without a gap is searched for the next header.
+        if ((unsigned long)(getUsec() - _resync.startUsec) > 2 * _frameTimeoutUsec) {
+          _resync.active = false;
+          _resync.search = true;
+
+        } else if (_uart->available() > 0) {
+          drop();
+          _resync.usec = getUsec();
+          return false;
+
+        } else if ((unsigned long)(getUsec() - _resync.usec) <= _frameTimeoutUsec)
+          return false;
+
+        else
+          _resync.active = false;
+      }
+
+      if (_resync.search)
+        drop(false);
+
+      if (_uart->available() == 0)
+        return false;
+
+      _usec = getUsec();
+
+      const uint8_t header = _uart->peek();
+      const bool extended  = (header & 0x0f) == extendedType;
+      if (!isHeader(header)) {
+        statistics.error++;
+        resync();
+        return false;
+      }
+
+      // Drop partial messages which don't complete in time.
+      if (_uart->available() < (extended ? 6 : 5)) {
+        if (_timeoutUsec == 0)
+          _timeoutUsec = getUsec();
+
+        if ((unsigned long)(getUsec() - _timeoutUsec) > _frameTimeoutUsec) {
+          drop();
+          _timeoutUsec = 0;
+          statistics.error++;
+        }
+
+        return false;
+      }
+
+      _timeoutUsec = 0;
+      _uart->read();
+      if (extended) {
+        packet->_type = header >> 4;
+        packet->_address = _uart->read();
+
+      } else {
+        packet->_type = header & 0x0f;
+        packet->_address = header >> 4;
+      }
+
+      _uart->readBytes(packet->_data, 4);
+      _resync.search = false;
+      statistics.input++;
+      _receiveUsec     = _usec;
+      _health.received = true;
+
+      if (_trace)
+        traceFrame(Trace::Event::Receive, _usec, header, extended, packet->_address, packet->_data);
+
+      return true;
+    }
+
+    bool send(uint8_t address, uint8_t type, const uint8_t *data) {
+      const unsigned long usec = getUsec();
+
+      if (!_active) {
+        if (_pinTx > 0)
+          digitalWrite(_pinTx, HIGH);
+
+        _active = true;
+        statistics.wake++;
+      }
+
+      // Average the time between the messages, the long pauses count as the
+      // maximum idle time.
+      {
+        uint32_t interval = usec - _sendUsec;
+        if (interval > _timing.powerDownMaxUsec)
+          interval = _timing.powerDownMaxUsec;
+
+        _intervalUsec += ((int32_t)interval - (int32_t)_intervalUsec) / 8;
+        _sendUsec = usec;
+      }
+
+      _usec = usec;
+
+      const bool extended = address > 0x0f;
+      if (_uart->availableForWrite() < (extended ? 6 : 5))
+        return false;
+
+      const uint8_t header = extended ? (type << 4) | extendedType : (address << 4) | type;
+      _uart->write(header);
+      if (extended)
+        _uart->write(address);
+
+      _uart->write(data, 4);
+      statistics.output++;
+
+      if (_trace)
+        traceFrame(Trace::Event::Send, usec, header, extended, address, data);
+
+      return true;
+    }
+
+    Uart *_uart;
+    const uint8_t _pinTx;
+    const Timing _timing;
+    uint32_t _baud{};
+    uint32_t _byteNsec{};
+    uint32_t _frameTimeoutUsec{};
+    int _txSize{};
+    bool _active{};
+    unsigned long _timeoutUsec{};
+    unsigned long _usec{};
+    unsigned long _sendUsec{};
+    unsigned long _receiveUsec{};
+    uint32_t _intervalUsec{};
+    Trace *_trace{};
+    uint8_t _traceIndex{};
+    bool _pass{};
+    unsigned long _passUsec{};
+
+    struct {
+      bool active;
+      bool search;
+      unsigned long startUsec;
+      unsigned long usec;
+    } _resync{};
+
+    void traceFrame(Trace::Event event,
+                    unsigned long usec,
+                    uint8_t header,
+                    bool extended,
+                    uint8_t address,
+                    const uint8_t *data) {
+      uint8_t bytes[6];
+      uint8_t length  = 0;
+      bytes[length++] = header;
+      if (extended)
+        bytes[length++] = address;
+
+      memcpy(bytes + length, data, 4);
+      _trace->record(usec, _traceIndex, event, bytes, length + 4);
+    }
+
+    // Discard the input, or only the bytes up to the next valid header. The
+    // bytes are recorded in the trace.
+    void drop(bool all = true) {
+      uint8_t bytes[8];
+      uint8_t length = 0;
+      while (_uart->available() > 0 && (all || !isHeader(_uart->peek()))) {
+        bytes[length++] = _uart->read();
+        if (length < sizeof(bytes))
+          continue;
+
+        if (_trace)
+          _trace->record(getUsec(), _traceIndex, Trace::Event::Drop, bytes, length);
+
+        length = 0;
+      }
+
+      if (_trace && length > 0)
+        _trace->record(getUsec(), _traceIndex, Trace::Event::Drop, bytes, length);
+    }
+
+    void resync() {
+      if (_trace)
+        _trace->record(getUsec(), _traceIndex, Trace::Event::Resync, nullptr, 0);
+
+      drop();
+      _timeoutUsec      = 0;
+      _resync.active    = true;
+      _resync.search    = false;
+      _resync.startUsec = getUsec();
+      _resync.usec      = _resync.startUsec;
+    }
+
+    // Power down the TX line driver after the outgoing buffer is flushed and the
+    // link has been idle for several times the usual interval between the
+    // messages. Regular traffic keeps the driver powered, the pauses between the
+    // phrases power it down.
+    void powerDown() {
+      if (!_active)
+        return;
+
+      uint32_t idleUsec = _intervalUsec * 4;
+      if (idleUsec < _timing.powerDownMinUsec)
+        idleUsec = _timing.powerDownMinUsec;
+
+      else if (idleUsec > _timing.powerDownMaxUsec)
+        idleUsec = _timing.powerDownMaxUsec;
+
+      if ((unsigned long)(getUsec() - _usec) < idleUsec + getSendDelay())
+        return;
+
+      if (_pinTx > 0)
+        digitalWrite(_pinTx, LOW);
+
+      _active = false;
+      statistics.sleep++;
+    }
+
+    // The time since the last received frame has arrived, estimated from the
+    // number of bytes which have arrived after it.
+    uint32_t getReceiveDelay() const {
+      return getBytesUsec(_uart->available());
+    }
+
+    // The time until the next sent frame will leave, estimated from the number of
+    // bytes queued in front of it.
+    uint32_t getSendDelay() const {
+      const int queued = _txSize - _uart->availableForWrite();
+      if (queued <= 0)
+        return 0;
+
+      return getBytesUsec(queued);
+    }
+
+    // The time to transfer the number of bytes.
+    uint32_t getBytesUsec(uint32_t bytes) const {
+      return bytes * _byteNsec / 1000;
+    }
+
+    // The UART is restarted without waiting for the pending output, which never
+    // completes with a stuck UART.
+    void setBaud(uint32_t baud) {
+      if (_baud > 0)
+        _uart->end();
+
+      _baud = baud;
+      _uart->begin(baud);
+      drop();
+
+      _timeoutUsec = 0;
+
+      // One byte is 10 bits on the wire. Allow a partial frame the time of five
+      // extended frames to complete, this is 100 µs at 3 Mhz.
+      _byteNsec         = 10ULL * 1000 * 1000 * 1000 / baud;
+      _frameTimeoutUsec = _timing.frameTimeoutUsec > 0 ? _timing.frameTimeoutUsec : getBytesUsec(5 * 6);
+    }
+
+    // The 'Link' frames are exchanged between the two ends of a link and are not
+    // forwarded. The address field carries the command, the data the baud rate:
+    //   Hello:     the child offers its highest rate
+    //   Switch:    the parent switches the link to the rate
+    //   Confirm:   sent at the new rate by both ends
+    //   Keepalive: sent if there was no other message for the keepalive interval
+    //   Attach:    sent by a device when it starts
+    enum class Link : uint8_t { Hello, Switch, Confirm, Keepalive, Attach };
+    static constexpr uint8_t maxOffers = 5;
+
+    struct {
+      // The child has received the rate from its parent.
+      bool negotiated;
+
+      // The current rate is confirmed by the other end.
+      bool confirmed;
+
+      // The lowest rate which has failed.
+      uint32_t failedBaud;
+
+      // The unanswered offers of the child.
+      uint8_t offers;
+
+      unsigned long usec;
+      uint32_t errors;
+    } _link{};
+
+    void sendLink(Link command, uint32_t baud) {
+      Packet packet;
+      packet._type = (uint8_t)Packet::Type::Link;
+      packet.setValue(baud);
+      send((uint8_t)command, &packet);
+    }
+
+    // The highest rate the child offers; after a failure, half of the failed rate.
+    uint32_t getOfferBaud() const {
+      uint32_t baud = _timing.maxBaud;
+      if (_link.failedBaud > 0 && baud >= _link.failedBaud)
+        baud = _link.failedBaud / 2;
+
+      return baud > _timing.baud ? baud : _timing.baud;
+    }
+
+    // The child confirms the new rate, the parent replies.
+    void switchBaud(uint32_t baud, bool plug) {
+      _uart->flush();
+      setBaud(baud);
+      _link.confirmed = baud == _timing.baud;
+      _link.usec      = getUsec();
+      _link.errors    = statistics.error;
+      if (plug && !_link.confirmed)
+        sendLink(Link::Confirm, baud);
+    }
+
+    void fallback() {
+      _link.failedBaud = _baud;
+      _link.negotiated = false;
+      _link.offers     = 0;
+      switchBaud(_timing.baud, false);
+    }
+
+    void loopLink(bool plug) {
+      if (_timing.maxBaud == 0)
+        return;
+
+      const unsigned long usec = getUsec();
+
+      if (_baud > _timing.baud) {
+        // The new rate needs to be confirmed in time.
+        if (!_link.confirmed) {
+          if ((unsigned long)(usec - _link.usec) > 50 * 1000)
+            fallback();
+
+          return;
+        }
+
+        // Fall back if the rate causes errors.
+        if ((unsigned long)(usec - _link.usec) > 1000 * 1000) {
+          if (statistics.error - _link.errors > 4) {
+            fallback();
+            return;
+          }
+
+          _link.usec   = usec;
+          _link.errors = statistics.error;
+        }
+
+        return;
+      }
+
+      // The child offers its rate until the parent has replied. A parent which
+      // does not support the negotiation never replies; the offers stop, and
+      // start again when the parent attaches or the link comes back up.
+      if (plug && !_link.negotiated && _link.offers < maxOffers &&
+          (unsigned long)(usec - _link.usec) > 100 * 1000) {
+        _link.usec = usec;
+        _link.offers++;
+        sendLink(Link::Hello, getOfferBaud());
+      }
+    }
+
+    // Returns true if the other end has attached.
+    bool receiveLink(const Packet *packet, bool plug) {
+      const uint32_t baud = packet->getValue();
+
+      switch ((Link)packet->getAddress()) {
+        case Link::Hello: {
+          if (plug || _timing.maxBaud == 0)
+            break;
+
+          uint32_t rate = _timing.maxBaud < baud ? _timing.maxBaud : baud;
+          if (_link.failedBaud > 0 && rate >= _link.failedBaud)
+            rate = _link.failedBaud / 2;
+
+          if (rate < _timing.baud)
+            rate = _timing.baud;
+
+          sendLink(Link::Switch, rate);
+          if (rate != _baud)
+            switchBaud(rate, false);
+
+          break;
+        }
+
+        case Link::Switch:
+          if (!plug || _timing.maxBaud == 0 || baud < _timing.baud || baud > _timing.maxBaud)
+            break;
+
+          _link.negotiated = true;
+          if (baud != _baud)
+            switchBaud(baud, true);
+
+          break;
+
+        case Link::Confirm:
+          if (baud != _baud || _link.confirmed)
+            break;
+
+          _link.confirmed = true;
+          _link.usec      = getUsec();
+          if (!plug)
+            sendLink(Link::Confirm, baud);
+
+          break;
+
+        case Link::Keepalive:
+          break;
+
+        case Link::Attach:
+          _link = {};
+          if (_baud != _timing.baud)
+            setBaud(_timing.baud);
+
+          return true;
+      }
+
+      return false;
+    }
+
+    struct {
+      State state;
+      bool down;
+      unsigned long usec;
+      uint32_t errors;
+
+      // A frame was received since the start, or since the socket went down.
+      bool received;
+    } _health{};
+
+    // Returns true if the state has changed.
+    bool loopHealth(bool plug) {
+      if (_timing.keepaliveUsec == 0)
+        return false;
+
+      // An empty socket, or a peer without keepalives, should not keep the TX
+      // line driver powered.
+      const unsigned long usec = getUsec();
+      if (_health.received && (unsigned long)(usec - _sendUsec) >= _timing.keepaliveUsec)
+        sendLink(Link::Keepalive, _baud);
+
+      if ((unsigned long)(usec - _health.usec) < _timing.keepaliveUsec)
+        return false;
+
+      _health.usec = usec;
+
+      State state;
+      if (!_health.received || (unsigned long)(usec - _receiveUsec) > 3 * _timing.keepaliveUsec)
+        state = State::Down;
+
+      else if (statistics.error != _health.errors)
+        state = State::Degraded;
+
+      else
+        state = State::Up;
+
+      _health.errors = statistics.error;
+
+      // Reset the UART and restart the negotiation when a link which has been up
+      // goes down; a stuck UART or a peer which has restarted at the initial rate.
+      // A socket stops sending keepalives until the child sends again, the plug
+      // keeps sending them to reach its parent when the cable is plugged back in.
+      if (state == State::Down && _health.state != State::Down && _health.received) {
+        _health.received = plug;
+        _link            = {};
+        setBaud(_timing.baud);
+      }
+
+      if (state == _health.state)
+        return false;
+
+      if (_health.state == State::Down)
+        _link.offers = 0;
+
+      _health.state = state;
+      return true;
+    }
+  };
+
+  // The handling of messages received from the socket.
+  //   Both:    forward to the parent device and call receiveSocket()
+  //   Forward: forward to the parent device only
+  //   Consume: call receiveSocket() only
+  enum class Policy : uint8_t { Both, Forward, Consume };
+
+  // A downstream socket of a hub. Messages to the addresses 'first' to 'last' are
+  // forwarded to 'port', the address is rebased to the first device of the branch.
+  struct Branch {
+    Port *port;
+    uint8_t first;
+    uint8_t last;
+  };
+
+  constexpr V2Link(Port *port_, Port *socket_) : plug(port_), socket(socket_) {}
+
+  // A hub with several sockets. The array is not copied and needs to be valid for
+  // the lifetime of the object. The 'socket' is set to the first branch.
+  constexpr V2Link(Port *port_, const Branch *branches, uint8_t count) :
+    plug(port_),
+    socket(count > 0 ? branches[0].port : nullptr),
+    _branches(branches),
+    _nBranches(count) {}
+
+  // Select the policy for messages of the given type from the child device at the
+  // given address. All addresses beyond 14 share one policy. Repeaters which are
+  // not interested in the traffic of their children skip the dispatch to
+  // receiveSocket() entirely.
+  void setPolicy(Packet::Type type, uint8_t address, Policy policy) {
+    const uint16_t bit = 1 << (address < 0x0f ? address : 0x0f);
+
+    _policy.noForward[(uint8_t)type] &= ~bit;
+    _policy.noConsume[(uint8_t)type] &= ~bit;
+
+    switch (policy) {
+      case Policy::Both:
+        break;
+
+      case Policy::Forward:
+        _policy.noConsume[(uint8_t)type] |= bit;
+        break;
+
+      case Policy::Consume:
+        _policy.noForward[(uint8_t)type] |= bit;
+        break;
+    }
+  }
+
+  // Select the policy for messages of the given type from all child devices.
+  void setPolicy(Packet::Type type, Policy policy) {
+    for (uint8_t i = 0; i <= 0x0f; i++)
+      setPolicy(type, i, policy);
+  }
+
+  // Send a bulk message to the given address of the port. The data is not copied,
+  // it needs to be valid until sendingBulk() returns false. The frames are sent
+  // from loop() as fast as the port accepts them. The firmwareTag is reserved.
+  bool sendBulk(Port *port, uint8_t address, uint8_t tag, const uint8_t *data, uint16_t length) {
+    if (tag == firmwareTag)
+      return false;
+
+    return startBulk(port, address, tag, nullptr, 0, data, length);
+  }
+
+  bool sendingBulk() const {
+    return _bulk.port;
+  }
+
+  // Broadcast a firmware image to all devices connected to the port. The image is
+  // not copied. The block size must fit into the bulk buffer of the devices, the
+  // pause between the blocks must cover the flash write of a block.
+  bool sendFirmware(Port *port, const uint8_t *image, uint32_t size, uint16_t blockSize, uint32_t blockUsec) {
+    if (_firmware.port || size == 0 || size > 0xffffff || blockSize == 0 || blockSize > 0xffff - 4)
+      return false;
+
+    _firmware.port      = port;
+    _firmware.image     = image;
+    _firmware.size      = size;
+    _firmware.position  = 0;
+    _firmware.blockSize = blockSize;
+    _firmware.blockUsec = blockUsec;
+    _firmware.usec      = V2LINK_MICROS() - blockUsec;
+    return true;
+  }
+
+  bool sendingFirmware() const {
+    return _firmware.port;
+  }
+
+  // Send a message to the device with the logical ID.
+  bool sendTo(uint8_t id, Packet *packet) {
+    uint8_t address;
+    if (!routes || !routes->getAddress(id, &address))
+      return false;
+
+    // The routes store the address relative to the parent device.
+    return forward(address + 1, packet);
+  }
+
+  // Announce the logical ID of this device to the parent devices, when the link
+  // is attached and then in the given interval. An interval of 0 disables the
+  // announcements.
+  void setAnnounce(uint8_t id, uint32_t intervalUsec) {
+    _announce.id           = id;
+    _announce.intervalUsec = intervalUsec;
+    _announce.usec         = V2LINK_MICROS() - intervalUsec;
+  }
+
+  // Synchronize the clock of this device with the parent device, which itself
+  // synchronizes with its parent. The root device provides the time for the entire
+  // chain. An interval of 0 disables the synchronization.
+  void setTimeSync(uint32_t intervalUsec) {
+    _time.intervalUsec = intervalUsec;
+  }
+
+  // The time of the root device in microseconds.
+  uint32_t getTime() const {
+    const unsigned long usec = V2LINK_MICROS();
+    return usec + _time.offset + (int32_t)(((int64_t)(int32_t)(usec - _time.usec) * _time.rate) >> 24);
+  }
+
+  bool isTimeSynced() const {
+    return _time.synced;
+  }
+
+  // Deliver the message at the given root time. The 'Schedule' frame carries the
+  // 32 bit time and is sent in front of the message; the receiving device queues
+  // the message and passes it to receivePlug() when the time is reached.
+  //
+  // A device without a synchronized clock, or a time more than 10 seconds ahead,
+  // delivers the message immediately.
+  bool sendScheduled(Port *port, uint8_t address, uint32_t usec, Packet *packet) {
+    // Both frames need to be queued together.
+    if (port->_uart->availableForWrite() < 12)
+      return false;
+
+    Packet schedule;
+    schedule._type = (uint8_t)Packet::Type::Schedule;
+    schedule.setValue(usec);
+    port->send(address, &schedule);
+    return port->send(address, packet);
+  }
+
+  // Record the traffic of all ports, nullptr stops the recording.
+  void setTrace(Trace *trace) {
+    if (plug)
+      plug->_trace = trace;
+
+    for (uint8_t i = 0; i < countBranches(); i++) {
+      Port *port        = getBranch(i).port;
+      port->_trace      = trace;
+      port->_traceIndex = i + 1;
+    }
+  }
+
+  void begin() {
+    if (plug)
+      plug->begin();
+
+    for (uint8_t i = 0; i < countBranches(); i++)
+      getBranch(i).port->begin();
+  }
+
+  void loop() {
+    Packet packet;
+
+    setPass(true, V2LINK_MICROS());
+    loopSchedule();
+
+    if (plug) {
+      if (plug->receive(&packet)) {
+        if (packet.getType() == Packet::Type::Link) {
+          if (plug->receiveLink(&packet, true))
+            attach(plug);
+
+        } else if (packet.getType() == Packet::Type::Time)
+          receiveTime(&packet);
+
+        else if (packet.getAddress() == broadcastAddress) {
+          for (uint8_t i = 0; i < countBranches(); i++)
+            getBranch(i).port->send(broadcastAddress, &packet);
+
+          if (!plug->_delivered)
+            dispatchPlug(&packet);
+
+        } else if (packet.getAddress() > 0)
+          forward(packet.getAddress(), &packet);
+
+        else
+          dispatchPlug(&packet);
+      }
+
+      loopTime();
+      loopAnnounce();
+      plug->loopLink(true);
+      if (plug->loopHealth(true))
+        changeLink(plug);
+
+      plug->powerDown();
+    }
+
+    for (uint8_t i = 0; i < countBranches(); i++) {
+      const Branch branch = getBranch(i);
+
+      if (branch.port->receive(&packet)) {
+        if (packet.getType() == Packet::Type::Link) {
+          if (branch.port->receiveLink(&packet, false))
+            attach(branch.port);
+
+        } else if (packet.getType() == Packet::Type::Time)
+          replyTime(branch.port, &packet);
+
+        else
+          receiveBranch(branch, &packet);
+      }
+
+      branch.port->loopLink(false);
+      if (branch.port->loopHealth(false))
+        changeLink(branch.port);
+
+      branch.port->powerDown();
+    }
+
+    loopBulk();
+    loopFirmware();
+    setPass(false);
+  }
+
+  bool idle() const {
+    if (plug && !plug->idle())
+      return false;
+
+    for (uint8_t i = 0; i < countBranches(); i++)
+      if (!getBranch(i).port->idle())
+        return false;
+
+    return true;
+  }
+
+  // Sleep until the next interrupt; incoming data, or the SysTick timer of the
+  // Arduino core which wakes up the CPU every millisecond. The CPU only enters the
+  // idle mode which keeps the UARTs clocked, no incoming data is lost. Returns
+  // false if there is pending work, and loop() should be called.
+  bool sleep() {
+    if (!canSleep())
+      return false;
+
+#if defined(ARDUINO_ARCH_SAMD)
+    SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+
+    // An interrupt which arrives after the check is pending and prevents the WFI
+    // from entering the sleep mode.
+    __disable_irq();
+    const bool sleep = canSleep();
+    if (sleep) {
+      __DSB();
+      __WFI();
+    }
+    __enable_irq();
+    return sleep;
+#else
+    return false;
+#endif
+  }
+
+  Port *plug{};
+  Port *socket{};
+
+  // The optional reassembly of bulk messages from the parent device, and from the
+  // child devices. Without a buffer, the frames are passed to receivePlug() and
+  // receiveSocket().
+  Bulk *plugBulk{};
+  Bulk *socketBulk{};
+
+  // The optional table of the logical IDs of the child devices.
+  Routes *routes{};
+
+protected:
+  virtual void receivePlug(Packet *packet) {}
+  virtual void receiveSocket(Packet *packet) {}
+  virtual void receivePlugBulk(uint8_t tag, const uint8_t *data, uint16_t length) {}
+  virtual void receiveSocketBulk(uint8_t address, uint8_t tag, const uint8_t *data, uint16_t length) {}
+
+  // Firmware update of this device. The blocks arrive in order, a failed write
+  // aborts the update. The finish call verifies and activates the image.
+  virtual bool writeFirmware(uint32_t offset, const uint8_t *data, uint16_t length) {
+    return false;
+  }
+
+  virtual bool finishFirmware(uint32_t size) {
+    return false;
+  }
+
+  // The reply of a child device to a firmware update.
+  virtual void receiveFirmwareStatus(uint8_t address, bool success, uint32_t size) {}
+
+  // The state of the link of the port has changed.
+  virtual void linkChanged(Port *port, Port::State state) {}
+
+  // A device has been connected to the port; the state of this device which
+  // depends on the other end of the link is already reset.
+  virtual void linkAttached(Port *port) {}
+
+  uint8_t countBranches() const {
+    if (_branches)
+      return _nBranches;
+
+    return socket ? 1 : 0;
+  }
+
+  // A device with a single socket serves all addresses.
+  Branch getBranch(uint8_t index) const {
+    if (_branches)
+      return _branches[index];
+
+    return {socket, 1, maxAddress};
+  }
+
+private:
+  const Branch *_branches{};
+  uint8_t _nBranches{};
+
+  struct {
+    Port *port;
+    uint8_t address;
+    uint8_t prefix[4];
+    uint8_t nPrefix;
+    const uint8_t *data;
+    uint16_t length;
+    uint16_t position;
+  } _bulk{};
+
+  struct {
+    Port *port;
+    const uint8_t *image;
+    uint32_t size;
+    uint32_t position;
+    uint16_t blockSize;
+    uint32_t blockUsec;
+    unsigned long usec;
+  } _firmware{};
+
+  // The firmware update received from the parent device.
+  struct {
+    uint32_t offset;
+    bool failed;
+  } _update{};
+
+  // The messages waiting for their time, ordered by time.
+  static constexpr uint8_t maxScheduled     = 16;
+  static constexpr uint32_t maxScheduleUsec = 10 * 1000 * 1000;
+  struct {
+    // The time of the next message from the parent with the same address.
+    bool pending;
+    uint8_t address;
+    uint32_t usec;
+
+    struct {
+      uint32_t usec;
+      uint8_t type;
+      uint8_t address;
+      alignas(4) uint8_t data[4];
+    } queue[maxScheduled];
+    uint8_t count;
+  } _schedule{};
+
+  // The clock synchronization is a request/reply exchange between a child and its
+  // parent device, the 'Time' frames are not forwarded. The address field carries
+  // the kind of message, the data the 32 bit timestamp:
+  //   Request:  the time the child has sent the request, in its local time
+  //   Receive:  the time the parent has received the request, in the root time
+  //   Transmit: the time the parent has sent the reply, in the root time
+  //
+  // The timestamps are corrected by the time the frames spend in the UART buffers;
+  // every device is synchronized to its parent, which makes the forwarding delays
+  // of the hops irrelevant.
+  enum class Time : uint8_t { Request, Receive, Transmit };
+
+  struct {
+    uint32_t intervalUsec;
+    bool synced;
+
+    // The offset to the root clock at the time of the last adjustment, and the
+    // drift since then in units of 2^-24.
+    uint32_t offset;
+    int32_t rate;
+    unsigned long usec;
+
+    // The smallest round-trip delay seen.
+    uint32_t delay;
+
+    // The pending request.
+    unsigned long requestUsec;
+    bool pending;
+    uint32_t request;
+    uint32_t receive;
+  } _time{};
+
+  // One bit per child address, indexed by the message type.
+  struct {
+    uint16_t noForward[16]{};
+    uint16_t noConsume[16]{};
+  } _policy;
+
+  struct {
+    uint8_t id;
+    uint32_t intervalUsec;
+    unsigned long usec;
+  } _announce{};
+
+  // Forward message from a parent device to a child device.
+  bool forward(uint8_t address, Packet *packet) {
+    for (uint8_t i = 0; i < countBranches(); i++) {
+      const Branch branch = getBranch(i);
+      if (address < branch.first || address > branch.last)
+        continue;
+
+      return branch.port->send(address - branch.first, packet);
+    }
+
+    return false;
+  }
+
+  void loopAnnounce() {
+    if (_announce.intervalUsec == 0)
+      return;
+
+    const unsigned long usec = plug->getUsec();
+    if ((unsigned long)(usec - _announce.usec) < _announce.intervalUsec)
+      return;
+
+    Packet packet;
+    packet._type = (uint8_t)Packet::Type::Announce;
+    memset(packet._data, 0, 4);
+    packet._data[0] = _announce.id;
+    if (!plug->send(0, &packet))
+      return;
+
+    _announce.usec = usec;
+  }
+
+  // The ports use the time of the loop() pass instead of reading the clock.
+  void setPass(bool pass, unsigned long usec = 0) {
+    if (plug) {
+      plug->_pass     = pass;
+      plug->_passUsec = usec;
+    }
+
+    for (uint8_t i = 0; i < countBranches(); i++) {
+      Port *port      = getBranch(i).port;
+      port->_pass     = pass;
+      port->_passUsec = usec;
+    }
+  }
+
+  void changeLink(Port *port) {
+    const Port::State state = port->getState();
+    linkChanged(port, state);
+
+    // A link which comes up again is likely connected to a new device.
+    if (state != Port::State::Down && port->_health.down)
+      attach(port);
+
+    port->_health.down = state == Port::State::Down;
+  }
+
+  // Drop the state which depends on the device at the other end of the link.
+  void attach(Port *port) {
+    if (port == plug) {
+      _time.synced      = false;
+      _time.pending     = false;
+      _time.requestUsec = V2LINK_MICROS() - _time.intervalUsec;
+      _schedule.pending = false;
+      plug->_hold       = false;
+      _update           = {};
+      _announce.usec    = V2LINK_MICROS() - _announce.intervalUsec;
+      if (plugBulk)
+        plugBulk->_active = false;
+
+    } else {
+      if (socketBulk)
+        socketBulk->_active = false;
+
+      // The devices behind the branch might have changed.
+      if (routes)
+        for (uint8_t i = 0; i < countBranches(); i++) {
+          const Branch branch = getBranch(i);
+          if (branch.port == port)
+            routes->remove(branch.first - 1, branch.last - 1);
+        }
+    }
+
+    linkAttached(port);
+  }
+
+  // Sleeping would delay incoming data, outgoing messages, or a scheduled message
+  // which is due before the next SysTick.
+  bool canSleep() const {
+    if (plug && (plug->_uart->available() > 0 || plug->_parked.pending))
+      return false;
+
+    for (uint8_t i = 0; i < countBranches(); i++) {
+      const Port *port = getBranch(i).port;
+      if (port->_uart->available() > 0 || port->_parked.pending)
+        return false;
+    }
+
+    if (_bulk.port || _firmware.port)
+      return false;
+
+    if (_schedule.count > 0 && (int32_t)(_schedule.queue[0].usec - getTime()) < 1000)
+      return false;
+
+    return true;
+  }
+
+  static bool isBulk(const Packet *packet) {
+    return packet->getType() == Packet::Type::Bulk || packet->getType() == Packet::Type::BulkData;
+  }
+
+  // The message is sent as the prefix followed by the data.
+  bool startBulk(Port *port,
+                 uint8_t address,
+                 uint8_t tag,
+                 const uint8_t *prefix,
+                 uint8_t nPrefix,
+                 const uint8_t *data,
+                 uint16_t length) {
+    if (_bulk.port || nPrefix > 4 || nPrefix + length == 0 || nPrefix + length > 0xffff)
+      return false;
+
+    uint8_t sum = 0;
+    for (uint8_t i = 0; i < nPrefix; i++)
+      sum += prefix[i];
+
+    for (uint16_t i = 0; i < length; i++)
+      sum += data[i];
+
+    Packet packet;
+    packet._type    = (uint8_t)Packet::Type::Bulk;
+    packet._data[0] = tag;
+    packet._data[1] = (nPrefix + length) >> 8;
+    packet._data[2] = (nPrefix + length) & 0xff;
+    packet._data[3] = sum;
+    if (!port->send(address, &packet))
+      return false;
+
+    _bulk.port    = port;
+    _bulk.address = address;
+    if (nPrefix > 0)
+      memcpy(_bulk.prefix, prefix, nPrefix);
+
+    _bulk.nPrefix  = nPrefix;
+    _bulk.data     = data;
+    _bulk.length   = nPrefix + length;
+    _bulk.position = 0;
+    return true;
+  }
+
+  void loopBulk() {
+    if (!_bulk.port)
+      return;
+
+    while (_bulk.position < _bulk.length) {
+      Packet packet;
+      packet._type = (uint8_t)Packet::Type::BulkData;
+
+      uint16_t n = _bulk.length - _bulk.position;
+      if (n > 4)
+        n = 4;
+
+      memset(packet._data, 0, 4);
+      for (uint8_t i = 0; i < n; i++) {
+        const uint16_t position = _bulk.position + i;
+        if (position < _bulk.nPrefix)
+          packet._data[i] = _bulk.prefix[position];
+
+        else
+          packet._data[i] = _bulk.data[position - _bulk.nPrefix];
+      }
+
+      if (!_bulk.port->send(_bulk.address, &packet))
+        return;
+
+      _bulk.position += n;
+    }
+
+    _bulk.port = nullptr;
+  }
+
+  void loopFirmware() {
+    if (!_firmware.port)
+      return;
+
+    // Start the pause after the last frame of the block is queued.
+    const unsigned long usec = _firmware.port->getUsec();
+    if (_bulk.port) {
+      _firmware.usec = usec;
+      return;
+    }
+
+    if ((unsigned long)(usec - _firmware.usec) < _firmware.blockUsec)
+      return;
+
+    if (_firmware.position < _firmware.size) {
+      uint32_t n = _firmware.size - _firmware.position;
+      if (n > _firmware.blockSize)
+        n = _firmware.blockSize;
+
+      const uint8_t offset[4]{
+        (uint8_t)(_firmware.position >> 24),
+        (uint8_t)(_firmware.position >> 16),
+        (uint8_t)(_firmware.position >> 8),
+        (uint8_t)_firmware.position,
+      };
+      if (!startBulk(_firmware.port, broadcastAddress, firmwareTag, offset, 4, _firmware.image + _firmware.position, n))
+        return;
+
+      _firmware.position += n;
+      _firmware.usec = usec;
+      return;
+    }
+
+    Packet packet;
+    packet._type    = (uint8_t)Packet::Type::Firmware;
+    packet._data[0] = (uint8_t)Firmware::Finish;
+    packet._data[1] = _firmware.size >> 16;
+    packet._data[2] = _firmware.size >> 8;
+    packet._data[3] = _firmware.size;
+    if (!_firmware.port->send(broadcastAddress, &packet))
+      return;
+
+    _firmware.port = nullptr;
+  }
+
+  void loopTime() {
+    if (_time.intervalUsec == 0)
+      return;
+
+    const unsigned long usec = V2LINK_MICROS();
+    if ((unsigned long)(usec - _time.requestUsec) < _time.intervalUsec)
+      return;
+
+    const uint32_t request = usec + plug->getSendDelay();
+
+    Packet packet;
+    packet._type = (uint8_t)Packet::Type::Time;
+    packet.setValue(request);
+    if (!plug->send((uint8_t)Time::Request, &packet))
+      return;
+
+    _time.requestUsec = usec;
+    _time.pending     = true;
+    _time.request     = request;
+  }
+
+  // The reply of the parent device to our request.
+  void receiveTime(const Packet *packet) {
+    switch ((Time)packet->getAddress()) {
+      case Time::Receive:
+        _time.receive = packet->getValue();
+        break;
+
+      case Time::Transmit: {
+        if (!_time.pending)
+          break;
+
+        _time.pending = false;
+
+        const uint32_t t1 = _time.request;
+        const uint32_t t2 = _time.receive;
+        const uint32_t t3 = packet->getValue();
+        const uint32_t t4 = V2LINK_MICROS() - plug->getReceiveDelay();
+
+        // Skip the samples which were delayed by other traffic, slowly forget the
+        // smallest delay to follow changes of the link.
+        int32_t delay = (t4 - t1) - (t3 - t2);
+        if (delay < 0)
+          delay = 0;
+
+        if (_time.synced && (uint32_t)delay > _time.delay + 20) {
+          _time.delay++;
+          break;
+        }
+
+        if (!_time.synced || (uint32_t)delay < _time.delay)
+          _time.delay = delay;
+
+        // The offset is the mean of the two directions.
+        const uint32_t forward = t2 - t1;
+        const uint32_t reverse = t3 - t4;
+        const uint32_t offset  = forward - (int32_t)(forward - reverse) / 2;
+        adjustTime(t4, offset);
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+
+  // Adjust the offset by a fraction of the measured error, and the rate by the
+  // error accumulated since the last adjustment.
+  void adjustTime(unsigned long usec, uint32_t offset) {
+    const int32_t elapsed = usec - _time.usec;
+    const uint32_t predicted =
+      _time.offset + (int32_t)(((int64_t)elapsed * _time.rate) >> 24);
+    const int32_t error = offset - predicted;
+
+    if (!_time.synced || error > 1000 || error < -1000) {
+      _time.offset = offset;
+      _time.rate   = 0;
+      _time.usec   = usec;
+      _time.synced = true;
+      return;
+    }
+
+    if (elapsed > 0)
+      _time.rate += (int32_t)((int64_t)error * (1 << 24) / elapsed / 8);
+
+    _time.offset = predicted + error / 4;
+    _time.usec   = usec;
+  }
+
+  // Reply to the request of a child device.
+  void replyTime(Port *port, const Packet *packet) {
+    if ((Time)packet->getAddress() != Time::Request)
+      return;
+
+    Packet reply;
+    reply._type = (uint8_t)Packet::Type::Time;
+    reply.setValue(getTime() - port->getReceiveDelay());
+    if (!port->send((uint8_t)Time::Receive, &reply))
+      return;
+
+    // The delay until the frame leaves includes the frame sent before.
+    reply.setValue(getTime() + port->getSendDelay());
+    port->send((uint8_t)Time::Transmit, &reply);
+  }
+
+  // Handle a message from a child device.
+  void receiveBranch(const Branch &branch, Packet *packet) {
+    // Drop the messages from devices beyond the range of the branch, they would
+    // alias the addresses of the next branch.
+    if (packet->getAddress() > branch.last - branch.first)
+      return;
+
+    // Rebase the address to this device, the direct child of the first branch
+    // is at address 0.
+    const uint8_t address = packet->getAddress() + branch.first - 1;
+
+    packet->setAddress(address);
+
+    if (routes && routes->_learn && packet->getType() == Packet::Type::Announce)
+      routes->set(packet->_data[0], address);
+
+    const uint8_t type = (uint8_t)packet->getType();
+    const uint16_t bit = 1 << (address < 0x0f ? address : 0x0f);
+
+    // Forward message from a child device towards the parent device, stop after
+    // too many hops.
+    if (plug && address < maxAddress && !(_policy.noForward[type] & bit))
+      plug->send(address + 1, packet);
+
+    if (type > Packet::maxType || (_policy.noConsume[type] & bit))
+      return;
+
+    if (packet->getType() == Packet::Type::Firmware) {
+      const uint32_t size = (packet->_data[1] << 16) | (packet->_data[2] << 8) | packet->_data[3];
+      receiveFirmwareStatus(address, packet->_data[0] == (uint8_t)Firmware::Success, size);
+      return;
+    }
+
+    if (socketBulk && isBulk(packet)) {
+      if (socketBulk->receive(packet))
+        receiveSocketBulk(socketBulk->_address, socketBulk->_tag, socketBulk->_buffer, socketBulk->_length);
+
+      return;
+    }
+
+    receiveSocket(packet);
+  }
+
+  void loopSchedule() {
+    if (_schedule.count == 0)
+      return;
+
+    const uint32_t usec = getTime();
+    while (_schedule.count > 0 && (int32_t)(_schedule.queue[0].usec - usec) <= 0) {
+      // The MIDI receive has not picked up the previous message.
+      if (isTransport(_schedule.queue[0].type) && plug->_parked.pending)
+        return;
+
+      Packet packet;
+      packet._address = _schedule.queue[0].address;
+      packet._type    = _schedule.queue[0].type;
+      memcpy(packet._data, _schedule.queue[0].data, 4);
+
+      _schedule.count--;
+      memmove(_schedule.queue, _schedule.queue + 1, _schedule.count * sizeof(_schedule.queue[0]));
+      if (isTransport(packet._type))
+        plug->park(&packet, false, true);
+
+      else
+        receivePlug(&packet);
+    }
+  }
+
+  // A MIDI message for this device, which is left to the MIDI receive of the plug.
+  bool isTransport(uint8_t type) const {
+    return plug && plug->_transport && type == (uint8_t)Packet::Type::MIDI;
+  }
+
+  // Returns false if the message is due and should be delivered now.
+  bool schedule(const Packet *packet, uint32_t usec) {
+    // The local clock is unrelated to the time of the root device.
+    if (!_time.synced)
+      return false;
+
+    const uint32_t now = getTime();
+    if ((int32_t)(usec - now) <= 0 || usec - now > maxScheduleUsec)
+      return false;
+
+    // Deliver late rather than lose the message.
+    if (_schedule.count == maxScheduled)
+      return false;
+
+    uint8_t i = _schedule.count;
+    while (i > 0 && (int32_t)(_schedule.queue[i - 1].usec - usec) > 0) {
+      _schedule.queue[i] = _schedule.queue[i - 1];
+      i--;
+    }
+
+    _schedule.queue[i].usec    = usec;
+    _schedule.queue[i].address = packet->_address;
+    _schedule.queue[i].type    = packet->_type;
+    memcpy(_schedule.queue[i].data, packet->_data, 4);
+    _schedule.count++;
+    return true;
+  }
+
+  // Handle a message for this device.
+  void dispatchPlug(Packet *packet) {
+    if (packet->getType() == Packet::Type::Schedule) {
+      _schedule.pending = true;
+      _schedule.address = packet->getAddress();
+      _schedule.usec    = packet->getValue();
+      plug->_hold       = true;
+      return;
+    }
+
+    // The types reserved for future messages are ignored.
+    const bool known = (uint8_t)packet->getType() <= Packet::maxType;
+
+    if (_schedule.pending && packet->getAddress() == _schedule.address) {
+      _schedule.pending = false;
+      plug->_hold       = false;
+      if (known && schedule(packet, _schedule.usec))
+        return;
+    }
+
+    if (!known)
+      return;
+
+    if (isTransport(packet->_type)) {
+      plug->park(packet, false, true);
+      return;
+    }
+
+    if (packet->getType() == Packet::Type::Firmware) {
+      if (packet->_data[0] == (uint8_t)Firmware::Finish)
+        finishUpdate((packet->_data[1] << 16) | (packet->_data[2] << 8) | packet->_data[3]);
+
+      return;
+    }
+
+    if (plugBulk && isBulk(packet)) {
+      if (!plugBulk->receive(packet))
+        return;
+
+      // The firmware blocks are always broadcast.
+      if (plugBulk->_tag == firmwareTag) {
+        if (plugBulk->_address == broadcastAddress)
+          receiveUpdate(plugBulk->_buffer, plugBulk->_length);
+
+      } else
+        receivePlugBulk(plugBulk->_tag, plugBulk->_buffer, plugBulk->_length);
+
+      return;
+    }
+
+    receivePlug(packet);
+  }
+
+  void receiveUpdate(const uint8_t *data, uint16_t length) {
+    if (length < 4)
+      return;
+
+    const uint32_t offset = ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+
+    // The first block starts a new update.
+    if (offset == 0)
+      _update = {};
+
+    if (_update.failed)
+      return;
+
+    if (offset != _update.offset || !writeFirmware(offset, data + 4, length - 4)) {
+      _update.failed = true;
+      return;
+    }
+
+    _update.offset += length - 4;
+  }
+
+  void finishUpdate(uint32_t size) {
+    const bool success = !_update.failed && _update.offset == size && finishFirmware(size);
+    _update            = {};
+
+    if (!plug)
+      return;
+
+    Packet packet;
+    packet._type    = (uint8_t)Packet::Type::Firmware;
+    packet._data[0] = (uint8_t)(success ? Firmware::Success : Firmware::Failure);
+    packet._data[1] = size >> 16;
+    packet._data[2] = size >> 8;
+    packet._data[3] = size;
+    plug->send(0, &packet);
+  }
 };